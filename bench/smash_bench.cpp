@@ -0,0 +1,456 @@
+/******************************************************************
+*
+*	Sam Opdahl
+*	Smash Interpreter
+*
+*	Benchmarks for the hot paths of the interpreter: the copy
+*	engine stages, directory listing, process launch, the
+*	tokenizer and the checksum. The results are printed as JSON, so runs of two
+*	releases can be compared.
+*
+*	smash_bench [--dir <scratch>] [--max-size <bytes>]
+*		[--max-entries <count>] [--repeats <count>]
+*		[--only copy|list|spawn|parse|hash] [--out <file>]
+*
+*******************************************************************/
+#include "smash.h"
+#include <sys/utsname.h>
+
+//holds the largest file copied when --max-size isn't given. the ladder
+//	goes on to 10G when it is raised.
+#define BENCH_MAX_SIZE (256 << 20)
+//holds the largest directory listed when --max-entries isn't given. the
+//	ladder goes on to 10M when it is raised.
+#define BENCH_MAX_ENTRIES 100000
+//holds how many times each case is measured, the best and median are kept.
+#define BENCH_REPEATS 3
+//holds how many launches each spawn case is timed over.
+#define BENCH_SPAWN_ITERATIONS 200
+//holds how many lines the tokenizer is timed over.
+#define BENCH_PARSE_LINES 200000
+//holds the size of the buffer the checksum is timed over in memory.
+#define BENCH_HASH_SIZE (64 << 20)
+
+//holds the command line of the benchmark.
+struct benchOptions {
+	string dir;
+	off_t maxSize;
+	long maxEntries;
+	int repeats;
+	//the only suite to run, empty for all of them.
+	string only;
+	string out;
+};
+
+//holds the JSON objects of every measurement, in the order they were taken.
+vector<string> results;
+
+//Post:	'opts' holds the options in 'argv', false is returned and the usage
+//			printed if they are invalid.
+bool parseBenchOptions(int argc, char** argv, benchOptions &opts);
+
+//Post:	The best and median of 'seconds' have been added to 'results' as
+//			the case 'name' of 'suite'. 'params' are more JSON members and
+//			'bytes' or 'items', if not 0, are turned into a rate. Without any
+//			'seconds' only the case and 'params' are added.
+void addResult(const char* suite, const string &name, const string &params, 
+	vector<double> seconds, double bytes, double items);
+
+//Post:	The copy engine stages, the whole engine, a 4 thread parallel copy and
+//			copy_cmd have been timed on files from 4K up to 'opts.maxSize'.
+void benchCopy(const benchOptions &opts);
+
+//Post:	list, list -s, list -l and list -R have been timed on directories of
+//			1K up to 'opts.maxEntries' empty files, with stdout on /dev/null,
+//			and so has expanding "f1*" and "**/f1*" in them.
+void benchList(const benchOptions &opts);
+
+//Post:	Each launch strategy and run_cmd have been timed starting /bin/true.
+void benchSpawn(const benchOptions &opts);
+
+//Post:	readLine and tokenize have been timed over a script of quoted lines.
+void benchParse(const benchOptions &opts);
+
+//Post:	xxh3Hash has been timed from 16 bytes up to BENCH_HASH_SIZE in memory,
+//			and hashFile on a file of 'opts.maxSize', with the kernel picked
+//			for this CPU.
+void benchHash(const benchOptions &opts);
+
+//Post:	'path' holds 'size' bytes of a repeating non-zero pattern.
+bool makeFile(const string &path, off_t size);
+
+//Post:	stdout is /dev/null while 'quiet', and restored afterwards. cout is
+//			flushed first so nothing lands on the wrong side.
+void silenceStdout(bool quiet);
+
+int main(int argc, char** argv) {
+	benchOptions opts;
+	if (!parseBenchOptions(argc, argv, opts))
+		return EXIT_FAILURE;
+
+	//the commands run as in a script: nothing is asked and nothing prompted.
+	session.interactive = false;
+	session.overwrite = OVERWRITE_ALWAYS;
+	initJobs();
+	initOutput(false);
+
+	if (opts.only.empty() || opts.only == "copy")
+		benchCopy(opts);
+	if (opts.only.empty() || opts.only == "list")
+		benchList(opts);
+	if (opts.only.empty() || opts.only == "spawn")
+		benchSpawn(opts);
+	if (opts.only.empty() || opts.only == "parse")
+		benchParse(opts);
+	if (opts.only.empty() || opts.only == "hash")
+		benchHash(opts);
+
+	utsname host;
+	uname(&host);
+	string json = "{\n  \"version\": \"" PROGRAM_VERSION "\",\n";
+	json += string("  \"kernel\": \"") + host.release + "\",\n";
+	json += "  \"cpus\": " + to_string(thread::hardware_concurrency()) + ",\n";
+	json += string("  \"io_uring\": ") + (uringAvailable() ? "true" : "false") + ",\n";
+	json += "  \"results\": [";
+	for (size_t i = 0; i < results.size(); i++)
+		json += (i ? ",\n    " : "\n    ") + results[i];
+	json += "\n  ]\n}\n";
+
+	int fd = STDOUT_FILENO;
+	if (!opts.out.empty())
+		fd = open(opts.out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1 || !writeAll(fd, json.data(), json.size())) {
+		cerr << "Unable to write the results: " << strerror(errno) << ".\n";
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+bool parseBenchOptions(int argc, char** argv, benchOptions &opts) {
+	const char* tmp = getenv("TMPDIR");
+	opts.dir = tmp != NULL ? tmp : "/tmp";
+	opts.maxSize = BENCH_MAX_SIZE;
+	opts.maxEntries = BENCH_MAX_ENTRIES;
+	opts.repeats = BENCH_REPEATS;
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (hasValue && strcmp(argv[i], "--dir") == 0)
+			opts.dir = argv[++i];
+		else if (hasValue && strcmp(argv[i], "--max-size") == 0)
+			opts.maxSize = parseSize(argv[++i]);
+		else if (hasValue && strcmp(argv[i], "--max-entries") == 0)
+			opts.maxEntries = parseSize(argv[++i]);
+		else if (hasValue && strcmp(argv[i], "--repeats") == 0)
+			opts.repeats = atoi(argv[++i]);
+		else if (hasValue && strcmp(argv[i], "--only") == 0)
+			opts.only = argv[++i];
+		else if (hasValue && strcmp(argv[i], "--out") == 0)
+			opts.out = argv[++i];
+		else
+			opts.repeats = 0;
+	}
+	if (opts.repeats < 1 || opts.maxSize < 0 || opts.maxEntries < 0) {
+		cerr << "Usage: smash_bench [--dir <scratch>] [--max-size <bytes>] "
+			"[--max-entries <count>] [--repeats <count>] [--only copy|list|spawn|parse|hash] "
+			"[--out <file>]\n";
+		return false;
+	}
+	return true;
+}
+
+void addResult(const char* suite, const string &name, const string &params, 
+	vector<double> seconds, double bytes, double items) {
+	//a case that couldn't run only says so.
+	if (seconds.empty()) {
+		results.push_back(string("{\"suite\": \"") + suite + "\", \"case\": \"" + name + 
+			"\", " + params + "}");
+		return;
+	}
+	sort(seconds.begin(), seconds.end());
+	double best = seconds[0];
+	double median = seconds[seconds.size() / 2];
+	char line[512];
+	int n = snprintf(line, sizeof(line), "{\"suite\": \"%s\", \"case\": \"%s\"%s%s, "
+		"\"repeats\": %zu, \"best_s\": %.9f, \"median_s\": %.9f", suite, name.c_str(), 
+		params.empty() ? "" : ", ", params.c_str(), seconds.size(), best, median);
+	if (bytes > 0)
+		n += snprintf(line + n, sizeof(line) - n, ", \"mb_per_s\": %.1f", bytes / best / 1e6);
+	if (items > 0)
+		n += snprintf(line + n, sizeof(line) - n, ", \"per_s\": %.1f", items / best);
+	snprintf(line + n, sizeof(line) - n, "}");
+	results.push_back(line);
+	cerr << suite << " " << name << " " << params << ": " << best << "s\n";
+}
+
+bool makeFile(const string &path, off_t size) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1)
+		return false;
+	vector<char> block(COPY_BUFFER_SIZE);
+	for (size_t i = 0; i < block.size(); i++)
+		block[i] = 'a' + i % 23;
+	bool ok = true;
+	for (off_t done = 0; done < size && ok; done += block.size())
+		ok = writeAll(fd, block.data(), min((off_t)block.size(), size - done));
+	close(fd);
+	return ok;
+}
+
+void silenceStdout(bool quiet) {
+	static int saved = -1;
+	cout.flush();
+	if (quiet) {
+		int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		saved = dup(STDOUT_FILENO);
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	}
+	else if (saved != -1) {
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+		saved = -1;
+	}
+}
+
+void benchCopy(const benchOptions &opts) {
+	const char* engines[] = { "reflink", "copy_file_range", "sendfile", "mmap", "splice", 
+		"buffer", "engine", "parallel_4", "verify", "copy_cmd" };
+	string src = opts.dir + "/smash_bench_src";
+	string dst = opts.dir + "/smash_bench_dst";
+	scratchArena scratch;
+	const off_t sizes[] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20, 256 << 20, 
+		1ll << 30, 4ll << 30, 10ll << 30 };
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= opts.maxSize; s++) {
+		off_t size = sizes[s];
+		if (!makeFile(src, size)) {
+			cerr << "Unable to create \"" << src << "\": " << strerror(errno) << ".\n";
+			break;
+		}
+		for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+			vector<double> seconds;
+			bool supported = true;
+			for (int r = 0; r < opts.repeats && supported; r++) {
+				int inFd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+				int outFd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+				off_t offset = 0;
+				copyResult result = COPY_DONE;
+				uint64_t start = monotonicNs();
+				switch (e) {
+				case 0: result = reflinkCopy(inFd, outFd); break;
+				case 1: result = rangeCopy(inFd, outFd, offset, size); break;
+				case 2: result = sendfileCopy(inFd, outFd, offset, size); break;
+				case 3: result = mmapCopy(inFd, outFd, offset, size); break;
+				case 4: result = spliceCopy(inFd, outFd, offset); break;
+				case 5: result = bufferCopy(inFd, outFd, offset); break;
+				case 6: result = copyFileData(inFd, outFd, size) ? COPY_DONE : COPY_FAILED; break;
+				case 7: result = parallelCopy(inFd, outFd, size, 4) ? COPY_DONE : COPY_FAILED; break;
+				case 8: {
+					uint64_t hash, badHash;
+					result = verifiedCopy(inFd, outFd, hash, badHash) ? COPY_DONE : COPY_FAILED;
+					break;
+				}
+				default: {
+					//the whole command, with its checks and opens.
+					char* a[] = { (char*)"copy", (char*)src.c_str(), (char*)dst.c_str(), NULL };
+					silenceStdout(true);
+					start = monotonicNs();
+					copy_cmd(a, 3, scratch);
+					scratch.reset();
+					silenceStdout(false);
+				}
+				}
+				uint64_t elapsed = monotonicNs() - start;
+				close(inFd);
+				close(outFd);
+				supported = result == COPY_DONE;
+				if (supported)
+					seconds.push_back(elapsed / 1e9);
+			}
+			string params = "\"size\": " + to_string(size);
+			if (!supported)
+				params += ", \"supported\": false";
+			if (!supported)
+				seconds.clear();
+			addResult("copy", engines[e], params, seconds, size, 0);
+		}
+		unlink(dst.c_str());
+	}
+	unlink(src.c_str());
+}
+
+void benchList(const benchOptions &opts) {
+	string dir = opts.dir + "/smash_bench_list";
+	const long counts[] = { 1000, 10000, 100000, 1000000, 10000000 };
+	const char* flags[] = { NULL, "-s", "-l", "-R" };
+	const char* names[] = { "list", "list_s", "list_l", "list_R" };
+	scratchArena scratch;
+	long made = 0;
+	mkdir(dir.c_str(), 0777);
+	int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirFd == -1) {
+		cerr << "Unable to create \"" << dir << "\": " << strerror(errno) << ".\n";
+		return;
+	}
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]) && counts[c] <= opts.maxEntries; c++) {
+		//each size only adds the files the previous one didn't have.
+		char name[32];
+		for (; made < counts[c]; made++) {
+			snprintf(name, sizeof(name), "f%ld", made);
+			int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+			if (fd == -1)
+				break;
+			close(fd);
+		}
+		for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+			vector<double> seconds;
+			for (int r = 0; r < opts.repeats; r++) {
+				char* a[4] = { (char*)"list", NULL, NULL, NULL };
+				int len = 1;
+				if (flags[f] != NULL)
+					a[len++] = (char*)flags[f];
+				a[len++] = (char*)dir.c_str();
+				silenceStdout(true);
+				uint64_t start = monotonicNs();
+				list_cmd(a, len, scratch);
+				scratch.reset();
+				uint64_t elapsed = monotonicNs() - start;
+				silenceStdout(false);
+				seconds.push_back(elapsed / 1e9);
+			}
+			addResult("list", names[f], "\"entries\": " + to_string(made), seconds, 0, made);
+		}
+
+		const char* patterns[] = { "/f1*", "/**/f1*" };
+		const char* globNames[] = { "glob", "glob_R" };
+		for (size_t g = 0; g < sizeof(patterns) / sizeof(patterns[0]); g++) {
+			string pattern = dir + patterns[g];
+			nameArena matches;
+			vector<double> seconds;
+			for (int r = 0; r < opts.repeats; r++) {
+				matches.clear();
+				uint64_t start = monotonicNs();
+				expandGlob(pattern.c_str(), matches);
+				seconds.push_back((monotonicNs() - start) / 1e9);
+			}
+			addResult("list", globNames[g], "\"entries\": " + to_string(made) + 
+				", \"matches\": " + to_string(matches.size()), seconds, 0, made);
+		}
+	}
+
+	char name[32];
+	for (long i = 0; i < made; i++) {
+		snprintf(name, sizeof(name), "f%ld", i);
+		unlinkat(dirFd, name, 0);
+	}
+	close(dirFd);
+	rmdir(dir.c_str());
+}
+
+void benchSpawn(const benchOptions &opts) {
+	char path[] = "/bin/true";
+	char* argv[] = { path, NULL };
+	scratchArena scratch;
+	for (int s = SPAWN_POSIX; s <= SPAWN_FORK + 1; s++) {
+		vector<double> seconds;
+		for (int i = 0; i < BENCH_SPAWN_ITERATIONS; i++) {
+			uint64_t start = monotonicNs();
+			if (s <= SPAWN_FORK) {
+				pid_t pid = spawnProcess(path, argv, (spawnStrategy)s);
+				if (pid == -1)
+					break;
+				waitpid(pid, NULL, 0);
+			}
+			else {
+				//the whole command, with the job table and epoll wait.
+				char* a[] = { (char*)"run", path, NULL };
+				run_cmd(a, 2, scratch);
+				scratch.reset();
+			}
+			seconds.push_back((monotonicNs() - start) / 1e9);
+		}
+		addResult("spawn", s <= SPAWN_FORK ? spawnNames[s] : "run_cmd", "", seconds, 0, 1);
+	}
+}
+
+void benchParse(const benchOptions &opts) {
+	//a mix of the lines scripts are made of, with quotes and escapes.
+	const char* lines[] = {
+		"copy -j 4 \"build/output file.bin\" /tmp/dst.bin\n",
+		"run /usr/bin/env 'LANG=C' printf \"%s\\n\" a\\ b c\n",
+		"list -l -s /var/log\n",
+		"run seq 1 10 | tee /tmp/seq.txt | run wc -l\n",
+	};
+	string script;
+	size_t tokens = 0;
+	for (int i = 0; i < BENCH_PARSE_LINES; i++)
+		script += lines[i % 4];
+
+	vector<char> work(script.size());
+	vector<double> seconds;
+	tokenList list;
+	for (int r = 0; r < opts.repeats; r++) {
+		//the tokenizer unquotes in place, each run starts from a fresh copy.
+		memcpy(work.data(), script.data(), script.size());
+		lineReader reader;
+		initReader(reader, work.data(), work.size());
+		char* line;
+		size_t length;
+		tokens = 0;
+		uint64_t start = monotonicNs();
+		while (readLine(reader, line, length)) {
+			tokenize(line, length, list);
+			tokens += list.tokens.size();
+		}
+		seconds.push_back((monotonicNs() - start) / 1e9);
+	}
+	addResult("parse", "tokenize", "\"lines\": " + to_string(BENCH_PARSE_LINES) + 
+		", \"tokens\": " + to_string(tokens), seconds, script.size(), BENCH_PARSE_LINES);
+}
+
+void benchHash(const benchOptions &opts) {
+	const char* kernel;
+	xxh3Kernel(&kernel);
+	vector<unsigned char> data(BENCH_HASH_SIZE);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = i * 2654435761u >> 13;
+	//the hashes are added up so they can't be optimized away.
+	volatile uint64_t sink = 0;
+	for (size_t size = 16; size <= BENCH_HASH_SIZE; size *= 16) {
+		//small inputs are hashed many times over so the clock can see them.
+		size_t rounds = max((size_t)1, ((size_t)16 << 20) / size);
+		vector<double> seconds;
+		for (int r = 0; r < opts.repeats; r++) {
+			uint64_t start = monotonicNs();
+			for (size_t i = 0; i < rounds; i++)
+				sink += xxh3Hash(data.data() + (i & 7), size - (i & 7));
+			seconds.push_back((monotonicNs() - start) / 1e9);
+		}
+		addResult("hash", "xxh3", "\"size\": " + to_string(size) + ", \"kernel\": \"" + 
+			kernel + "\"", seconds, (double)size * rounds, rounds);
+	}
+
+	string src = opts.dir + "/smash_bench_hash";
+	if (!makeFile(src, opts.maxSize)) {
+		cerr << "Unable to create \"" << src << "\": " << strerror(errno) << ".\n";
+		return;
+	}
+	vector<double> seconds;
+	for (int r = 0; r < opts.repeats; r++) {
+		int fd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+		uint64_t hash = 0;
+		uint64_t start = monotonicNs();
+		bool ok = fd != -1 && hashFile(fd, hash);
+		uint64_t elapsed = monotonicNs() - start;
+		if (fd != -1)
+			close(fd);
+		if (!ok)
+			break;
+		sink += hash;
+		seconds.push_back(elapsed / 1e9);
+	}
+	unlink(src.c_str());
+	addResult("hash", "hash_file", "\"size\": " + to_string(opts.maxSize) + ", \"kernel\": \"" + 
+		kernel + "\"", seconds, opts.maxSize, 0);
+}
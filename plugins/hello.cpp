@@ -0,0 +1,28 @@
+/******************************************************************
+*
+*	Smash Interpreter
+*	Example plugin
+*
+*	Adds "hello [<name>]", which greets without starting a process.
+*	Build it into a directory on $SMASH_PLUGIN_PATH:
+*		g++ -std=c++17 -O2 -shared -fPIC -I.. hello.cpp -o hello.so
+*
+*******************************************************************/
+#include <iostream>
+#include "smash_plugin.h"
+
+using namespace std;
+
+//Post:	A greeting has been printed for each name, or for the world.
+static void hello_cmd(char** a, int len) {
+	if (len == 1)
+		cout << "Hello, world!\n";
+	for (int i = 1; i < len; i++)
+		cout << "Hello, " << a[i] << "!\n";
+}
+
+extern "C" int smash_plugin_init(const smash_plugin_host* host) {
+	if (host->abi_version != SMASH_PLUGIN_ABI_VERSION)
+		return -1;
+	return host->register_command("hello", hello_cmd);
+}
@@ -0,0 +1,5402 @@
+/******************************************************************
+*
+*	Sam Opdahl
+*	Smash Interpreter
+*
+*	The commands of the interpreter and the engines behind them.
+*
+*******************************************************************/
+#include "smash.h"
+
+//true when the kernel supports every io_uring operation the engines use.
+//	set once by uringInitEngine, the POSIX paths are used otherwise.
+bool uringEnabled = false;
+
+//holds the locations of the programs run by name.
+pathCache commandPaths;
+
+//holds every job that was started with run.
+jobTable runningJobs;
+//holds the directory listings of a --list-cache session.
+listCache listings;
+//holds the output of every command until it is written to stdout.
+outputSink stdoutSink(STDOUT_FILENO);
+//holds where a parallel worker's output goes.
+thread_local vector<char>* capturedOutput = NULL;
+
+// -- Command Functions --
+
+void help_cmd(char** a, int len, scratchArena &scratch) {
+	cout << "\tWelcome to smash v" << PROGRAM_VERSION << "!\n\n";
+	cout << "\tThe following is a list of valid commands:\n\n";
+	cout << "\trun [-p <pipe-size>] <executable-file> [<arguments>...] [&]\n";
+	cout << "\trun <program> | [tee <file> |] run <program> ... [&]\n";
+	cout << "\tjobs [--json | -0]\n";
+	cout << "\twait [<job-number>]\n";
+	cout << "\tfg [<job-number>]\n";
+	cout << "\thash [-r | <file>...]\n";
+	cout << "\talias [<name> <command>]\n";
+	cout << "\tplugin [load <file>]\n";
+	cout << "\ttime <command>\n";
+	cout << "\tstats [-r | --json | -0]\n";
+	cout << "\ttrace [on | off | clear]\n";
+	cout << "\ttrace dump [--folded] [<file>]\n";
+	cout << "\tparallel [-j <jobs>] <command> [<arguments>...] ::: <argument>...\n";
+	cout << "\tparallel [-j <jobs>] <command> [<arguments>...] :::: <file>\n";
+	cout << "\tlist\n";
+	cout << "\tlist <directory>\n";
+	cout << "\tlist [-l] [-s] [<directory>]\n";
+	cout << "\tlist -R [-u] [-l] [-j <threads>] [<directory>]\n";
+	cout << "\tlist [--json | -0] [<options>...] [<directory>]\n";
+	cout << "\tcopy <old-filename> <new-filename>\n";
+	cout << "\tcopy -j <threads> <old-filename> <new-filename>\n";
+	cout << "\tcopy -r [-j <threads>] <old-directory> <new-directory>\n";
+	cout << "\tcopy --direct [-j <queue-depth>] <old-filename> <new-filename>\n";
+	cout << "\tcopy --verify <old-filename> <new-filename>\n";
+	cout << "\tcopy --update [-j <threads>] <old-filename> <new-filename>\n";
+	cout << "\thelp\n";
+	cout << "\tquit\n\n";
+	cout << "\tNote: All commands are case insensitive (arguments are not).\n";
+}
+
+void quit_cmd(char** a, int len, scratchArena &scratch) {
+	if (session.interactive)
+		cout << "Thanks for choosing smash!\n";
+	exit(EXIT_SUCCESS);
+}
+
+void copy_cmd(char** a, int len, scratchArena &scratch) {
+	copyOptions opts;
+	int argIndex = parseCopyOptions(a, len, opts);
+	if (argIndex == -1)
+		return;
+	if (len - argIndex != 2) {
+		cout << "Invalid number of arguments.\n";
+		cout << "Usage: copy [-r] [--direct | --verify | --update] [-j <threads>] <old-filename> <new-filename>\n";
+		return;
+	}
+	char* src = a[argIndex];
+	char* dst = a[argIndex + 1];
+
+	//Check if the same file is trying to copied to itself.
+	//if this were to happen, the file would be clobbered.
+	if (strcmp(src, dst) == 0) {
+		cout << "Cannot copy same file!\n";
+		return;
+	}
+	
+	//also compare the inodes, so that a different path to the same file
+	//(a link or "./file") is caught before the output file is truncated.
+	struct stat inStat, outStat;
+	if (stat(src, &inStat) == 0 && stat(dst, &outStat) == 0 &&
+		inStat.st_dev == outStat.st_dev && inStat.st_ino == outStat.st_ino) {
+		cout << "Cannot copy same file!\n";
+		return;
+	}
+
+	if (opts.recursive && stat(src, &inStat) == 0 && S_ISDIR(inStat.st_mode)) {
+		treeCopy(src, dst, opts.jobs);
+		return;
+	}
+
+	if (opts.update) {
+		updateFile(src, dst, opts.jobs > 0 ? opts.jobs : DELTA_JOBS);
+		return;
+	}
+
+	ifstream inStream;
+	ofstream outStream;
+	//the streams are only opened to check the files, a byte each of the
+	//stack is enough of a buffer and keeps them from allocating one.
+	char unused[2];
+	inStream.rdbuf()->pubsetbuf(unused, 1);
+	outStream.rdbuf()->pubsetbuf(unused + 1, 1);
+
+	//attempt open and validate the streams.
+	//the overwrite question is timed on its own so the summary of a parallel
+	//copy only counts the time spent moving data.
+	bool valid = createInStream(inStream, src);
+	chrono::steady_clock::time_point promptStart = chrono::steady_clock::now();
+	valid = valid && validateOutFile(dst);
+	chrono::duration<double> promptTime = chrono::steady_clock::now() - promptStart;
+	if (!valid || !createOutStream(outStream, dst)) {
+		inStream.close();
+		outStream.close();
+		return;
+	}
+	//the streams have validated both files, the data itself is moved by the
+	//copy engine which needs raw file descriptors.
+	inStream.close();
+	outStream.close();
+
+	int inFd = open(src, O_RDONLY | O_CLOEXEC);
+	int outFd = open(dst, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (inFd == -1 || outFd == -1 || fstat(inFd, &inStat) == -1) {
+		cout << "Unable to open \"" << src << "\" or \"" << dst << "\": " 
+			 << strerror(errno) << ".\n";
+	}
+	else if (opts.verify) {
+		uint64_t hash, badHash;
+		if (!S_ISREG(inStat.st_mode)) {
+			cout << "Only regular files can be verified.\n";
+		}
+		else if (verifiedCopy(inFd, outFd, hash, badHash)) {
+			cout << "Copied and verified, xxh3 " << hexHash(hash, scratch) << ".\n";
+		}
+		else if (errno == EBADMSG) {
+			cout << "Verification failed: \"" << src << "\" has xxh3 " << hexHash(hash, scratch) 
+				 << ", \"" << dst << "\" has " << hexHash(badHash, scratch) << ".\n";
+		}
+		else {
+			cout << "Error copying \"" << src << "\": " << strerror(errno) << ".\n";
+		}
+	}
+	else if (opts.direct && S_ISREG(inStat.st_mode) && inStat.st_size > 0) {
+		//"-j" is the queue depth of a direct copy.
+		int depth = opts.jobs > 0 ? opts.jobs : DIRECT_QUEUE_DEPTH;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		copyResult result = directCopy(inFd, outFd, inStat.st_size, depth);
+		chrono::duration<double> copyTime = chrono::steady_clock::now() - start;
+		if (result == COPY_DONE) {
+			cout << "Copied ";
+			printThroughput(inStat.st_size, copyTime.count());
+			cout << " with direct I/O, queue depth " << depth << ".\n";
+		}
+		else if (result == COPY_UNSUPPORTED) {
+			cout << "Direct I/O isn't supported for \"" << src << "\" or \"" << dst 
+				 << "\", using the copy engine.\n";
+			if (!copyFileData(inFd, outFd, inStat.st_size))
+				cout << "Error copying \"" << src << "\": " << strerror(errno) << ".\n";
+		}
+		else {
+			cout << "Error copying \"" << src << "\": " << strerror(errno) << ".\n";
+		}
+	}
+	else if (opts.jobs > 0 && S_ISREG(inStat.st_mode) && inStat.st_size > 0) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		if (parallelCopy(inFd, outFd, inStat.st_size, opts.jobs)) {
+			chrono::duration<double> copyTime = chrono::steady_clock::now() - start;
+			cout << "Copied ";
+			printThroughput(inStat.st_size, copyTime.count());
+			cout << " with " << opts.jobs << " threads.\n";
+			cout << "Transfer: " << copyTime.count() << "s, waiting for overwrite prompt: "
+				 << promptTime.count() << "s.\n";
+		}
+		else {
+			cout << "Error copying \"" << src << "\": " << strerror(errno) << ".\n";
+		}
+	}
+	else if (!copyFileData(inFd, outFd, S_ISREG(inStat.st_mode) ? inStat.st_size : 0)) {
+		cout << "Error copying \"" << src << "\": " << strerror(errno) << ".\n";
+	}
+
+	if (inFd != -1)
+		close(inFd);
+	if (outFd != -1)
+		close(outFd);
+}
+
+void updateFile(const char* src, const char* dst, int jobs) {
+	struct stat inStat, outStat;
+	int inFd = open(src, O_RDONLY | O_CLOEXEC);
+	if (inFd == -1 || fstat(inFd, &inStat) == -1 || !S_ISREG(inStat.st_mode)) {
+		cout << "Unable to open \"" << src << "\": " 
+			 << (inFd == -1 ? strerror(errno) : "not a regular file") << ".\n";
+		if (inFd != -1)
+			close(inFd);
+		return;
+	}
+	//the cheapest check first: a destination with the source's size and
+	//modification time was left by an earlier update.
+	bool exists = stat(dst, &outStat) == 0;
+	if (exists && outStat.st_size == inStat.st_size && 
+		outStat.st_mtim.tv_sec == inStat.st_mtim.tv_sec && 
+		outStat.st_mtim.tv_nsec == inStat.st_mtim.tv_nsec) {
+		cout << "\"" << dst << "\" is up to date.\n";
+		close(inFd);
+		return;
+	}
+	//an update rewrites the destination in place, so it is an overwrite
+	//	like any other copy's. -f and asking allow it.
+	if (exists && session.overwrite == OVERWRITE_NEVER) {
+		cout << "File \"" << dst << "\" already exists, not overwriting it.\n";
+		close(inFd);
+		return;
+	}
+
+	int outFd = open(dst, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (outFd == -1) {
+		cout << "Unable to open \"" << dst << "\": " << strerror(errno) << ".\n";
+		close(inFd);
+		return;
+	}
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	off_t changed = inStat.st_size;
+	bool ok;
+	//a new or empty destination has nothing to compare against.
+	if (!exists || outStat.st_size == 0 || !S_ISREG(outStat.st_mode))
+		ok = ftruncate(outFd, 0) == 0 && copyFileData(inFd, outFd, inStat.st_size);
+	else
+		ok = deltaCopy(inFd, outFd, inStat.st_size, jobs, changed);
+	chrono::duration<double> copyTime = chrono::steady_clock::now() - start;
+	//the next update can then stop at the first check.
+	struct timespec times[2] = { inStat.st_atim, inStat.st_mtim };
+	if (ok && futimens(outFd, times) == -1)
+		ok = false;
+	if (ok) {
+		cout << "Updated ";
+		printThroughput(changed, 0);
+		cout << " of ";
+		printThroughput(inStat.st_size, copyTime.count());
+		cout << ".\n";
+	}
+	else {
+		cout << "Error updating \"" << dst << "\": " << strerror(errno) << ".\n";
+	}
+	close(inFd);
+	close(outFd);
+}
+
+void list_cmd(char** a, int len, scratchArena &scratch) {
+	listOptions opts;
+	int argIndex = parseListOptions(a, len, opts);
+	if (argIndex == -1)
+		return;
+	if (len - argIndex > 1) {
+		cout << "Too many arguments.\n";
+		cout << "Usage: list [-l] [-s] [--json | -0] [-R [-u] [-j <threads>]] [<directory>]\n";
+		return;
+	}
+
+	//open user's supplied directory, 
+	//if no directory was supplied, use current dir.
+	int dirFd = open((argIndex < len) ? a[argIndex] : "./", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirFd == -1) {
+		cout << "Unable to open the directory.\n";
+		return;
+	}
+
+	if (opts.recursive) {
+		treeList(dirFd, opts);
+		close(dirFd);
+		return;
+	}
+	outputBuffer out(STDOUT_FILENO);
+	bool ok = true;
+	if (session.listCache) {
+		ok = cachedList(dirFd, opts, out);
+	}
+	else if (!opts.longFormat && !opts.sorted) {
+		ok = listNames(dirFd, opts.format, out);
+	}
+	else {
+		nameArena arena(scratch);
+		long n;
+		//unsorted long listings are printed one getdents buffer at a time,
+		//a sorted listing needs every name before the first can be printed.
+		while ((n = readNames(dirFd, arena)) > 0) {
+			if (!opts.sorted) {
+				printNames(dirFd, arena, opts.longFormat, opts.format, out);
+				arena.clear();
+			}
+		}
+		ok = n == 0;
+		if (opts.sorted) {
+			sortNames(arena);
+			printNames(dirFd, arena, opts.longFormat, opts.format, out);
+		}
+	}
+	out.flush();
+	if (!ok)
+		cout << "Error reading the directory: " << strerror(errno) << ".\n";
+	close(dirFd);
+}
+
+void run_cmd(char** a, int len, scratchArena &scratch) {
+	bool background = len > 2 && strcmp(a[len - 1], "&") == 0;
+	if (background)
+		len--;
+	pipeStage stage;
+	if (!parseRunStage(a, len, stage, scratch))
+		return;
+
+	//under parallel the program's output is collected like a builtin's,
+	//	and it is waited for here since the job table belongs to the
+	//	interpreter's thread.
+	if (capturedOutput != NULL) {
+		int status = captureProgram(stage.path, stage.argv, *capturedOutput);
+		if (status == -1 && errno == ENOENT && refreshStage(stage, scratch))
+			status = captureProgram(stage.path, stage.argv, *capturedOutput);
+		if (status == -1) {
+			if (errno == ENOENT)
+				cout << "Unable to find executable file \"" << stage.argv[0] << "\".\n";
+			else
+				cout << "Unable to run \"" << stage.argv[0] << "\": " << strerror(errno) << ".\n";
+		}
+		return;
+	}
+
+	pid_t p = launchProgram(stage.path, stage.argv);
+	if (p == -1 && errno == ENOENT && refreshStage(stage, scratch))
+		p = launchProgram(stage.path, stage.argv);
+
+	//make sure the program could be started
+	if (p == -1) {
+		if (errno == ENOENT)
+			cout << "Unable to find executable file \"" << stage.argv[0] << "\".\n";
+		else
+			cout << "Unable to run \"" << stage.argv[0] << "\": " << strerror(errno) << ".\n";
+		return;
+	}
+
+	scratchString command(stage.argv[0], scratch);
+	for (size_t i = 1; stage.argv[i] != NULL; i++)
+		command.append(" ").append(stage.argv[i]);
+	job* j = addJob(&p, 1, command, background);
+
+	//a background job keeps running while the prompt comes back, otherwise
+	//make the interpreter wait for it to finish execution.
+	if (background) {
+		cout << "[" << j->id << "] " << p << "\n";
+		return;
+	}
+	waitJob(j);
+	removeJob(j);
+}
+
+void jobs_cmd(char** a, int len, scratchArena &scratch) {
+	outputFormat format = len == 2 ? parseFormat(a[1]) : FORMAT_TEXT;
+	if (len > 2 || (len == 2 && format == FORMAT_TEXT)) {
+		cout << "Usage: jobs [--json | -0]\n";
+		return;
+	}
+	//collect what finished so the states are current. finished jobs have
+	//been reported once they are listed here, so they are removed.
+	pollJobs(0);
+	outputBuffer out(STDOUT_FILENO);
+	for (size_t i = 0; i < runningJobs.jobs.size(); ) {
+		job* j = runningJobs.jobs[i];
+		if (!j->background) {
+			i++;
+			continue;
+		}
+		if (format == FORMAT_TEXT)
+			printJob(j);
+		else
+			appendJobRecord(out, j, format);
+		if (j->remaining == 0)
+			removeJob(j);
+		else
+			i++;
+	}
+}
+
+void wait_cmd(char** a, int len, scratchArena &scratch) {
+	if (len > 2) {
+		cout << "Usage: wait [<job-number>]\n";
+		return;
+	}
+	if (len == 2) {
+		job* j = findJob(atoi(a[1]));
+		if (j == NULL) {
+			cout << "No such job \"" << a[1] << "\".\n";
+			return;
+		}
+		waitJob(j);
+		return;
+	}
+	for (size_t i = 0; i < runningJobs.jobs.size(); i++) {
+		if (runningJobs.jobs[i]->background)
+			waitJob(runningJobs.jobs[i]);
+	}
+}
+
+void fg_cmd(char** a, int len, scratchArena &scratch) {
+	if (len > 2) {
+		cout << "Usage: fg [<job-number>]\n";
+		return;
+	}
+	job* j = NULL;
+	if (len == 2) {
+		j = findJob(atoi(a[1]));
+	}
+	else {
+		//without a number the most recent background job is used.
+		for (size_t i = runningJobs.jobs.size(); i > 0 && j == NULL; i--) {
+			if (runningJobs.jobs[i - 1]->background)
+				j = runningJobs.jobs[i - 1];
+		}
+	}
+	if (j == NULL) {
+		cout << "No such job.\n";
+		return;
+	}
+	cout << j->command << "\n";
+	j->background = false;
+	waitJob(j);
+	removeJob(j);
+}
+
+void hash_cmd(char** a, int len, scratchArena &scratch) {
+	if (len == 2 && strcmp(a[1], "-r") == 0) {
+		lock_guard<mutex> guard(commandPaths.lock);
+		commandPaths.entries.clear();
+		return;
+	}
+	if (len > 1 && a[1][0] != '-') {
+		for (int i = 1; i < len; i++) {
+			int fd = open(a[i], O_RDONLY | O_CLOEXEC);
+			uint64_t hash;
+			if (fd == -1 || !hashFile(fd, hash))
+				cout << "hash: \"" << a[i] << "\": " << strerror(errno) << ".\n";
+			else
+				cout << hexHash(hash, scratch) << "  " << a[i] << "\n";
+			if (fd != -1)
+				close(fd);
+		}
+		return;
+	}
+	if (len != 1) {
+		cout << "Usage: hash [-r | <file>...]\n";
+		return;
+	}
+	lock_guard<mutex> guard(commandPaths.lock);
+	if (commandPaths.entries.empty()) {
+		cout << "hash: the cache is empty.\n";
+		return;
+	}
+	cout << "hits\tcommand\n";
+	unordered_map<string, pathCacheEntry>::iterator iter;
+	for (iter = commandPaths.entries.begin(); iter != commandPaths.entries.end(); ++iter)
+		cout << iter->second.hits << "\t" << iter->second.path << "\n";
+}
+
+void alias_cmd(char** a, int len, scratchArena &scratch) {
+	if (len == 1) {
+		for (size_t i = 0; i < extraCommands.aliases.size(); i++)
+			cout << "alias " << extraCommands.aliases[i].first << " " << extraCommands.aliases[i].second << "\n";
+		return;
+	}
+	if (len != 3) {
+		cout << "Invalid number of arguments.\n";
+		cout << "Usage: alias [<name> <command>]\n";
+		return;
+	}
+	//only the first word is lower cased by the tokenizer. the target is
+	//	lower cased too, so it resolves like the command typed directly.
+	string name = a[1];
+	for (size_t i = 0; i < name.size(); i++)
+		name[i] = tolower((unsigned char)name[i]);
+	for (char* c = a[2]; *c != '\0'; c++)
+		*c = tolower((unsigned char)*c);
+	function fn = findCommand(a[2]);
+	if (fn == NULL) {
+		cout << "Unrecognized command: \"" << a[2] << "\".\n";
+		return;
+	}
+	if (!registerCommand(name, fn)) {
+		cout << "\"" << name << "\" is a builtin command.\n";
+		return;
+	}
+	//a plugin's command is found by the name it was typed as.
+	string_view key = extraCommands.entries.find(name)->first;
+	unordered_map<string_view, smash_command>::iterator target = extraCommands.external.find(a[2]);
+	if (fn == pluginCommand && target != extraCommands.external.end())
+		extraCommands.external[key] = target->second;
+	else
+		extraCommands.external.erase(key);
+	for (size_t i = 0; i < extraCommands.aliases.size(); i++) {
+		if (extraCommands.aliases[i].first == name) {
+			extraCommands.aliases[i].second = a[2];
+			return;
+		}
+	}
+	extraCommands.aliases.push_back(make_pair(key, string(a[2])));
+}
+
+void plugin_cmd(char** a, int len, scratchArena &scratch) {
+	if (len == 3 && strcmp(a[1], "load") == 0) {
+		loadPlugin(a[2]);
+		return;
+	}
+	if (len != 1) {
+		cout << "Invalid number of arguments.\n";
+		cout << "Usage: plugin [load <file>]\n";
+		return;
+	}
+	for (size_t i = 0; i < extraCommands.plugins.size(); i++) {
+		const string* path = &extraCommands.plugins[i].second;
+		cout << *path << ":";
+		unordered_map<string_view, const string*>::iterator iter;
+		for (iter = extraCommands.owners.begin(); iter != extraCommands.owners.end(); ++iter) {
+			if (iter->second == path)
+				cout << " " << iter->first;
+		}
+		cout << "\n";
+	}
+}
+
+void time_cmd(char** a, int len, scratchArena &scratch) {
+	if (len < 2) {
+		cout << "Invalid number of arguments.\n";
+		cout << "Usage: time <command>\n";
+		return;
+	}
+	//the command word after the prefix wasn't lower cased by the tokenizer.
+	for (char* c = a[1]; *c != '\0'; c++)
+		*c = tolower((unsigned char)*c);
+	bool piped = false;
+	for (int i = 1; i < len && !piped; i++)
+		piped = strcmp(a[i], "|") == 0;
+
+	//children are reaped with wait4 and their usage summed into the job
+	//table, the interpreter's own comes from getrusage.
+	rusage selfBefore, selfAfter;
+	rusage childBefore = runningJobs.foregroundUsage;
+	//the peak of the jobs this command runs, kept apart from the session's.
+	long outerPeak = runningJobs.foregroundPeak;
+	runningJobs.foregroundPeak = 0;
+	getrusage(RUSAGE_SELF, &selfBefore);
+	uint64_t start = monotonicNs();
+	bool ran = runCommand(a + 1, len - 1, piped, scratch);
+	uint64_t wall = monotonicNs() - start;
+	getrusage(RUSAGE_SELF, &selfAfter);
+	long peak = runningJobs.foregroundPeak;
+	runningJobs.foregroundPeak = max(outerPeak, peak);
+	if (!ran)
+		return;
+	const rusage &childAfter = runningJobs.foregroundUsage;
+
+	//a builtin's time is the interpreter's, a program's is its children's.
+	bool children = childAfter.ru_utime.tv_sec != childBefore.ru_utime.tv_sec || 
+		childAfter.ru_utime.tv_usec != childBefore.ru_utime.tv_usec ||
+		childAfter.ru_stime.tv_sec != childBefore.ru_stime.tv_sec ||
+		childAfter.ru_stime.tv_usec != childBefore.ru_stime.tv_usec ||
+		childAfter.ru_minflt != childBefore.ru_minflt;
+	const rusage &after = children ? childAfter : selfAfter;
+	const rusage &before = children ? childBefore : selfBefore;
+	double user = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + 
+		(after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6;
+	double sys = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + 
+		(after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+
+	char line[160];
+	snprintf(line, sizeof(line), "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", 
+		wall / 1e9, user, sys);
+	cout << line;
+	//getrusage only has the interpreter's lifetime peak, so a builtin's
+	//	RSS is labelled as that.
+	snprintf(line, sizeof(line), "maxrss\t%ld KB%s\nfaults\t%ld major, %ld minor\n"
+		"ctxsw\t%ld voluntary, %ld involuntary\n", children ? peak : selfAfter.ru_maxrss, 
+		children ? "" : " (interpreter peak)", after.ru_majflt - before.ru_majflt, after.ru_minflt - before.ru_minflt,
+		after.ru_nvcsw - before.ru_nvcsw, after.ru_nivcsw - before.ru_nivcsw);
+	cout << line;
+}
+
+void stats_cmd(char** a, int len, scratchArena &scratch) {
+	if (len == 2 && strcmp(a[1], "-r") == 0) {
+		memset(commandCounters.builtins, 0, sizeof(commandCounters.builtins));
+		memset(&commandCounters.pipelines, 0, sizeof(commandCounters.pipelines));
+		commandCounters.extra.clear();
+		return;
+	}
+	outputFormat format = len == 2 ? parseFormat(a[1]) : FORMAT_TEXT;
+	if (len > 2 || (len == 2 && format == FORMAT_TEXT)) {
+		cout << "Invalid number of arguments.\n";
+		cout << "Usage: stats [-r | --json | -0]\n";
+		return;
+	}
+	if (format != FORMAT_TEXT) {
+		outputBuffer out(STDOUT_FILENO);
+		for (size_t i = 0; i < BUILTIN_COUNT; i++)
+			appendStatsRecord(out, builtinCommands[i].name, commandCounters.builtins[i], format);
+		unordered_map<string_view, commandStats>::iterator iter;
+		for (iter = commandCounters.extra.begin(); iter != commandCounters.extra.end(); ++iter)
+			appendStatsRecord(out, iter->first, iter->second, format);
+		appendStatsRecord(out, "(pipeline)", commandCounters.pipelines, format);
+		int64_t allocations = heapAllocations.load(memory_order_relaxed);
+		if (format == FORMAT_JSON) {
+			out.append("{\"heap_allocations\":", 20);
+			appendNumber(out, allocations);
+			out.append("}\n", 2);
+		}
+		else {
+			out.append("heap_allocations\t", 17);
+			appendNumber(out, allocations);
+			out.append("", 1);
+		}
+		return;
+	}
+	char line[128];
+	snprintf(line, sizeof(line), "%-12s %10s %12s %12s %12s %12s\n", "command", "calls", 
+		"total ms", "mean us", "max us", "allocs/call");
+	cout << line;
+	for (size_t i = 0; i < BUILTIN_COUNT; i++)
+		printStats(builtinCommands[i].name, commandCounters.builtins[i]);
+	unordered_map<string_view, commandStats>::iterator iter;
+	for (iter = commandCounters.extra.begin(); iter != commandCounters.extra.end(); ++iter)
+		printStats(iter->first, iter->second);
+	printStats("(pipeline)", commandCounters.pipelines);
+	snprintf(line, sizeof(line), "heap allocations: %llu\n", 
+		(unsigned long long)heapAllocations.load(memory_order_relaxed));
+	cout << line;
+}
+
+void trace_cmd(char** a, int len, scratchArena &scratch) {
+	if (len == 2 && strcmp(a[1], "on") == 0) {
+		tracingEnabled.store(true, memory_order_relaxed);
+		return;
+	}
+	if (len == 2 && strcmp(a[1], "off") == 0) {
+		tracingEnabled.store(false, memory_order_relaxed);
+		return;
+	}
+	if (len == 2 && strcmp(a[1], "clear") == 0) {
+		clearTrace();
+		return;
+	}
+	int i = 2;
+	bool folded = i < len && strcmp(a[i], "--folded") == 0;
+	if (folded)
+		i++;
+	if (len < 2 || strcmp(a[1], "dump") != 0 || len - i > 1) {
+		cout << "Invalid number of arguments.\n";
+		cout << "Usage: trace [on | off | clear]\n";
+		cout << "       trace dump [--folded] [<file>]\n";
+		return;
+	}
+	int fd = STDOUT_FILENO;
+	if (i < len) {
+		if (!validateOutFile(a[i]))
+			return;
+		fd = open(a[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			cout << "Unable to create \"" << a[i] << "\": " << strerror(errno) << "\n";
+			return;
+		}
+	}
+	{
+		outputBuffer out(fd);
+		dumpTrace(out, folded);
+	}
+	if (fd != STDOUT_FILENO)
+		close(fd);
+}
+
+void parallel_cmd(char** a, int len, scratchArena &scratch) {
+	int jobs = thread::hardware_concurrency();
+	int i = 1;
+	if (i + 1 < len && strcmp(a[i], "-j") == 0) {
+		char* end;
+		long n = strtol(a[i + 1], &end, 10);
+		if (*end != '\0' || n < 1 || n > PARALLEL_MAX_JOBS) {
+			cout << "Invalid job count \"" << a[i + 1] << "\".\n";
+			return;
+		}
+		jobs = n;
+		i += 2;
+	}
+	int separator = i;
+	while (separator < len && strcmp(a[separator], ":::") != 0 && strcmp(a[separator], "::::") != 0)
+		separator++;
+	bool fromFile = separator < len && strcmp(a[separator], "::::") == 0;
+	if (separator == i || separator == len || (fromFile && len - separator != 2)) {
+		cout << "Invalid number of arguments.\n";
+		cout << "Usage: parallel [-j <jobs>] <command> [<arguments>...] ::: <argument>...\n";
+		cout << "       parallel [-j <jobs>] <command> [<arguments>...] :::: <file>\n";
+		return;
+	}
+
+	//the command word after the prefix wasn't lower cased by the tokenizer.
+	for (char* c = a[i]; *c != '\0'; c++)
+		*c = tolower((unsigned char)*c);
+	parallelRun run;
+	run.fn = findCommand(a[i]);
+	if (run.fn == NULL) {
+		cout << "Unrecognized command: \"" << a[i] << "\".\n";
+		return;
+	}
+	//the job table, the command tables and the session belong to the
+	//	interpreter's thread, so what uses them can't run in a worker.
+	if (run.fn == parallel_cmd || run.fn == quit_cmd || run.fn == jobs_cmd || run.fn == wait_cmd || 
+		run.fn == fg_cmd || run.fn == time_cmd || run.fn == alias_cmd || run.fn == plugin_cmd) {
+		cout << "parallel: \"" << a[i] << "\" can't be run in parallel.\n";
+		return;
+	}
+	run.placeholder = false;
+	for (int w = i; w < separator; w++) {
+		run.words.push_back(a[w]);
+		run.placeholder = run.placeholder || strstr(a[w], "{}") != NULL;
+	}
+	if (fromFile) {
+		if (!readArgumentFile(a[separator + 1], run.args, scratch))
+			return;
+	}
+	else {
+		run.args.assign(a + separator + 1, a + len);
+	}
+	if (run.args.empty())
+		return;
+
+	run.outputs.resize(run.args.size());
+	run.done.assign(run.args.size(), 0);
+	run.next = 0;
+	jobs = min((size_t)max(jobs, 1), run.args.size());
+
+	//a worker can't answer an overwrite prompt, existing files are kept.
+	overwritePolicy policy = session.overwrite;
+	if (policy == OVERWRITE_ASK)
+		session.overwrite = OVERWRITE_NEVER;
+	cout.flush();
+	vector<thread> workers;
+	for (int w = 0; w < jobs; w++)
+		workers.push_back(thread(parallelWorker, ref(run)));
+
+	//each run's output is printed as soon as the runs before it are done,
+	//	so the order never depends on which worker was faster.
+	for (size_t task = 0; task < run.args.size(); task++) {
+		{
+			unique_lock<mutex> guard(run.lock);
+			while (!run.done[task])
+				run.finished.wait(guard);
+		}
+		vector<char> &out = run.outputs[task];
+		if (!out.empty())
+			stdoutSink.write(out.data(), out.size());
+		vector<char>().swap(out);
+	}
+	for (size_t w = 0; w < workers.size(); w++)
+		workers[w].join();
+	session.overwrite = policy;
+}
+
+// -- Helper Functions --
+
+lineReader input;
+
+sessionOptions session;
+
+void initReader(lineReader &reader, int fd, size_t size) {
+	reader.fd = fd;
+	reader.buffer.resize(size);
+	reader.data = reader.buffer.data();
+	reader.capacity = size;
+	reader.begin = 0;
+	reader.end = 0;
+	reader.eof = false;
+}
+
+void initReader(lineReader &reader, char* data, size_t length) {
+	reader.fd = -1;
+	reader.data = data;
+	reader.capacity = length;
+	reader.begin = 0;
+	reader.end = length;
+	reader.eof = true;
+}
+
+bool openScript(lineReader &reader, const char* fileName) {
+	int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		cout << "Unable to open script \"" << fileName << "\": " << strerror(errno) << ".\n";
+		return false;
+	}
+	//a private mapping lets the tokenizer unquote in place without the
+	//changes reaching the file. the whole script is then read without a copy.
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			close(fd);
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			initReader(reader, (char*)map, st.st_size);
+			return true;
+		}
+	}
+	initReader(reader, fd, BATCH_BUFFER_SIZE);
+	return true;
+}
+
+bool parseSession(int argc, char** argv, sessionOptions &opts) {
+	opts.overwrite = OVERWRITE_ASK;
+	opts.interactive = false;
+	opts.listCache = false;
+	opts.asyncOutput = false;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+		if (strcmp(argv[i], "-f") == 0)
+			opts.overwrite = OVERWRITE_ALWAYS;
+		else if (strcmp(argv[i], "-n") == 0)
+			opts.overwrite = OVERWRITE_NEVER;
+		else if (strcmp(argv[i], "--list-cache") == 0)
+			opts.listCache = true;
+		else if (strcmp(argv[i], "--async-output") == 0)
+			opts.asyncOutput = true;
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			break;
+		else {
+			cout << "Usage: smash [-f|-n] [--list-cache] [--async-output] [-c <commands> | <script>]\n";
+			return false;
+		}
+	}
+
+	if (i < argc && strcmp(argv[i], "-c") == 0) {
+		//the arguments are writable and NUL terminated, so they are read in place.
+		initReader(input, argv[i + 1], strlen(argv[i + 1]));
+		i += 2;
+	}
+	else if (i < argc && strcmp(argv[i], "-") != 0) {
+		if (!openScript(input, argv[i]))
+			return false;
+		i++;
+	}
+	else {
+		//"-" or no script reads stdin, with the prompt only for a terminal.
+		if (i < argc)
+			i++;
+		opts.interactive = isatty(STDIN_FILENO);
+		initReader(input, STDIN_FILENO, opts.interactive ? INPUT_BUFFER_SIZE : BATCH_BUFFER_SIZE);
+	}
+	if (i != argc) {
+		cout << "Usage: smash [-f|-n] [--list-cache] [--async-output] [-c <commands> | <script>]\n";
+		return false;
+	}
+	//a script is never asked about overwriting, there's nobody to answer.
+	if (!opts.interactive && opts.overwrite == OVERWRITE_ASK)
+		opts.overwrite = OVERWRITE_NEVER;
+	return true;
+}
+
+bool readLine(lineReader &reader, char* &line, size_t &length) {
+	//the prompt or question has to be on the screen before we block.
+	if (session.interactive)
+		cout.flush();
+	size_t scanned = reader.begin;
+	while (true) {
+		char* start = reader.data + reader.begin;
+		char* newline = (char*)memchr(reader.data + scanned, '\n', reader.end - scanned);
+		if (newline != NULL) {
+			line = start;
+			length = newline - start;
+			reader.begin = newline - reader.data + 1;
+			return true;
+		}
+		if (reader.eof) {
+			//a last line without a newline still counts.
+			if (reader.begin == reader.end)
+				return false;
+			line = start;
+			length = reader.end - reader.begin;
+			reader.begin = reader.end;
+			//the tokenizer needs a byte after the line for its NUL, when the
+			//line ends the buffer or mapping it's copied out first.
+			//	the line may be in 'buffer' itself, so it goes to a new one
+			//	that becomes the reader's data.
+			if (reader.end == reader.capacity) {
+				vector<char> tail(length + 1);
+				memcpy(tail.data(), start, length);
+				tail[length] = '\0';
+				reader.buffer.swap(tail);
+				reader.data = reader.buffer.data();
+				reader.capacity = reader.buffer.size();
+				reader.begin = reader.end = length;
+				line = reader.data;
+			}
+			return true;
+		}
+
+		//move the partial line to the front, and grow the buffer only when
+		//that line fills all of it.
+		if (reader.begin > 0) {
+			memmove(reader.data, start, reader.end - reader.begin);
+			reader.end -= reader.begin;
+			reader.begin = 0;
+		}
+		scanned = reader.end;
+		if (reader.end == reader.capacity) {
+			reader.buffer.resize(reader.capacity * 2);
+			reader.data = reader.buffer.data();
+			reader.capacity = reader.buffer.size();
+		}
+
+		ssize_t n = read(reader.fd, reader.data + reader.end, reader.capacity - reader.end);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			reader.eof = true;
+		else
+			reader.end += n;
+	}
+}
+
+bool readAnswer(lineReader &reader, string &answer) {
+	if (session.interactive)
+		cout.flush();
+	answer.clear();
+	//a line that is already buffered is copied out where it is.
+	char* start = reader.data + reader.begin;
+	size_t pending = reader.end - reader.begin;
+	char* newline = (char*)memchr(start, '\n', pending);
+	if (newline != NULL) {
+		answer.assign(start, newline - start);
+		reader.begin += newline - start + 1;
+		return true;
+	}
+	answer.assign(start, pending);
+	reader.begin = reader.end;
+	if (reader.eof || reader.fd == -1)
+		return pending > 0;
+	//the rest comes a byte at a time, so nothing after the answer is read
+	//	and has to be kept for the next command.
+	while (true) {
+		char c;
+		ssize_t n = read(reader.fd, &c, 1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			reader.eof = true;
+			return !answer.empty();
+		}
+		if (c == '\n')
+			return true;
+		answer.push_back(c);
+	}
+}
+
+//the classes of each character for the tokenizer, so an ordinary one is
+//	told apart with a single lookup. GLOB_WILDCARD marks the ones that make
+//	an unquoted word a pattern and GLOB_ESCAPED the ones that are escaped in
+//	the pattern when they were quoted.
+enum { TOKEN_SPACE = 1, TOKEN_QUOTE = 2, TOKEN_ESCAPE = 4, GLOB_WILDCARD = 8, GLOB_ESCAPED = 16 };
+struct tokenCharacterTable {
+	unsigned char classes[256];
+	constexpr tokenCharacterTable() : classes() {
+		//the characters isspace accepts in the C locale.
+		classes[' '] = classes['\t'] = classes['\n'] = TOKEN_SPACE;
+		classes['\v'] = classes['\f'] = classes['\r'] = TOKEN_SPACE;
+		classes['\''] = classes['"'] = TOKEN_QUOTE;
+		classes['\\'] = TOKEN_ESCAPE | GLOB_ESCAPED;
+		classes['*'] = classes['?'] = classes['['] = GLOB_WILDCARD | GLOB_ESCAPED;
+		classes[']'] = GLOB_ESCAPED;
+	}
+};
+static constexpr tokenCharacterTable tokenCharacters;
+
+bool tokenize(char* line, size_t length, tokenList &list) {
+	list.tokens.clear();
+	list.args.clear();
+	list.piped = false;
+	list.globs.clear();
+	list.patterns.clear();
+	list.expanded.clear();
+	list.quotedMetas.clear();
+
+	//unquoting only ever shrinks a word, so each one is written back over
+	//the line at 'out' while 'in' reads ahead of it.
+	char* in = line;
+	char* lineEnd = line + length;
+	while (true) {
+		while (in < lineEnd && (tokenCharacters.classes[(unsigned char)*in] & TOKEN_SPACE))
+			in++;
+		if (in == lineEnd)
+			break;
+
+		char* start = in;
+		char* out = in;
+		bool quoted = false;
+		unsigned char wildcard = 0;
+		while (in < lineEnd) {
+			unsigned char type = tokenCharacters.classes[(unsigned char)*in];
+			if (type == 0) {
+				*out++ = *in++;
+				continue;
+			}
+			if (type & TOKEN_SPACE)
+				break;
+			char c = *in++;
+			if (type & TOKEN_QUOTE) {
+				quoted = true;
+				while (in < lineEnd && *in != c) {
+					if (c == '"' && *in == '\\' && in + 1 < lineEnd && 
+						(in[1] == '"' || in[1] == '\\'))
+						in++;
+					if (tokenCharacters.classes[(unsigned char)*in] & GLOB_ESCAPED)
+						list.quotedMetas.push_back(out - start);
+					*out++ = *in++;
+				}
+				if (in == lineEnd) {
+					cout << "Unterminated " << (c == '"' ? "double" : "single") << " quote.\n";
+					list.tokens.clear();
+					list.args.clear();
+					list.globs.clear();
+					return false;
+				}
+				in++;
+			}
+			else if ((type & TOKEN_ESCAPE) && in < lineEnd) {
+				quoted = true;
+				if (tokenCharacters.classes[(unsigned char)*in] & GLOB_ESCAPED)
+					list.quotedMetas.push_back(out - start);
+				*out++ = *in++;
+			}
+			else {
+				wildcard |= type;
+				*out++ = c;
+			}
+		}
+
+		//there is always room for the NUL, the word ended on a separator, a
+		//closing quote or the newline that was cut off the line.
+		bool separator = in < lineEnd;
+		*out = '\0';
+		if (separator)
+			in++;
+
+		//convert the first argument (the command) to lower case for easier processing later
+		if (list.tokens.empty()) {
+			for (char* c = start; c < out; c++)
+				*c = tolower((unsigned char)*c);
+		}
+		if (!quoted && out - start == 1 && *start == '|')
+			list.piped = true;
+
+		//the command word is never expanded.
+		if ((wildcard & GLOB_WILDCARD) && !list.tokens.empty())
+			addGlobWord(list, start, out);
+		list.quotedMetas.clear();
+		list.tokens.push_back(string_view(start, out - start));
+		list.args.push_back(start);
+	}
+	if (!list.globs.empty())
+		expandGlobs(list);
+	list.args.push_back(NULL);
+	return true;
+}
+
+//kept out of line, the tokenizer's loop stays small for the lines without
+//	wildcards.
+__attribute__((noinline))
+void addGlobWord(tokenList &list, const char* start, const char* end) {
+	//a word whose wildcards were all written unquoted is its own pattern,
+	//	otherwise the quoted ones are escaped in a copy.
+	globWord word;
+	word.token = list.tokens.size();
+	word.pattern = NO_PATTERN;
+	if (!list.quotedMetas.empty()) {
+		word.pattern = list.patterns.size();
+		size_t m = 0;
+		for (const char* c = start; c < end; c++) {
+			if (m < list.quotedMetas.size() && list.quotedMetas[m] == (size_t)(c - start)) {
+				list.patterns.push_back('\\');
+				m++;
+			}
+			list.patterns.push_back(*c);
+		}
+		list.patterns.push_back('\0');
+	}
+	list.globs.push_back(word);
+}
+
+void expandGlobs(tokenList &list) {
+	static thread_local nameArena matches;
+	size_t added = 0;
+	for (size_t i = 0; i < list.globs.size(); i++) {
+		globWord &word = list.globs[i];
+		const char* pattern = word.pattern == NO_PATTERN ? list.args[word.token] : 
+			&list.patterns[word.pattern];
+		matches.clear();
+		word.first = list.expanded.size();
+		word.count = expandGlob(pattern, matches);
+		for (size_t m = 0; m < word.count; m++) {
+			const char* name = matches.name(m);
+			list.expanded.insert(list.expanded.end(), name, name + strlen(name) + 1);
+		}
+		if (word.count > 0)
+			added += word.count - 1;
+	}
+	if (list.expanded.empty())
+		return;
+
+	//the paths take the place of their word. the tokens are moved up from
+	//	the back, so nothing is overwritten before it has been moved.
+	size_t oldSize = list.args.size();
+	size_t j = oldSize + added;
+	list.args.resize(j);
+	list.tokens.resize(j);
+	size_t g = list.globs.size();
+	for (size_t i = oldSize; i > 0; i--) {
+		size_t token = i - 1;
+		if (g > 0 && list.globs[g - 1].token == token && list.globs[g - 1].count > 0) {
+			const globWord &word = list.globs[--g];
+			j -= word.count;
+			char* name = &list.expanded[word.first];
+			for (size_t m = 0; m < word.count; m++) {
+				size_t nameLength = strlen(name);
+				list.args[j + m] = name;
+				list.tokens[j + m] = string_view(name, nameLength);
+				name += nameLength + 1;
+			}
+			continue;
+		}
+		if (g > 0 && list.globs[g - 1].token == token)
+			g--;
+		j--;
+		list.args[j] = list.args[token];
+		list.tokens[j] = list.tokens[token];
+	}
+}
+
+bool parse(tokenList &list) {
+	char* line;
+	size_t length;
+	if (!readLine(input, line, length))
+		return false;
+	tokenize(line, length, list);
+	return true;
+}
+
+int parseCopyOptions(char** a, int len, copyOptions &opts) {
+	opts.jobs = 0;
+	opts.recursive = false;
+	opts.direct = false;
+	opts.verify = false;
+	opts.update = false;
+	int i = 1;
+	for (; i < len && a[i][0] == '-'; i++) {
+		if (strcmp(a[i], "-j") == 0 && i + 1 < len) {
+			char* end;
+			long jobs = strtol(a[++i], &end, 10);
+			if (*end != '\0' || jobs < 1 || jobs > 1024) {
+				cout << "Invalid thread count \"" << a[i] << "\".\n";
+				return -1;
+			}
+			opts.jobs = jobs;
+		}
+		else if (strcmp(a[i], "-r") == 0) {
+			opts.recursive = true;
+		}
+		else if (strcmp(a[i], "--direct") == 0) {
+			opts.direct = true;
+		}
+		else if (strcmp(a[i], "--verify") == 0) {
+			opts.verify = true;
+		}
+		else if (strcmp(a[i], "--update") == 0) {
+			opts.update = true;
+		}
+		else {
+			cout << "Unknown option \"" << a[i] << "\".\n";
+			cout << "Usage: copy [-r] [--direct | --verify | --update] [-j <threads>] <old-filename> <new-filename>\n";
+			return -1;
+		}
+	}
+	//a verified copy does its own read and write pass.
+	if (opts.verify && (opts.recursive || opts.direct || opts.jobs > 0)) {
+		cout << "--verify can't be combined with -r, -j or --direct.\n";
+		return -1;
+	}
+	if (opts.update && (opts.recursive || opts.direct || opts.verify)) {
+		cout << "--update can't be combined with -r, --direct or --verify.\n";
+		return -1;
+	}
+	return i;
+}
+
+int parseListOptions(char** a, int len, listOptions &opts) {
+	opts.longFormat = false;
+	opts.sorted = false;
+	opts.recursive = false;
+	opts.unordered = false;
+	opts.jobs = 0;
+	opts.format = FORMAT_TEXT;
+	int i = 1;
+	for (; i < len && a[i][0] == '-' && a[i][1] != '\0'; i++) {
+		if (strcmp(a[i], "--json") == 0) {
+			opts.format = FORMAT_JSON;
+			continue;
+		}
+		if (strcmp(a[i], "-j") == 0 && i + 1 < len) {
+			char* end;
+			long jobs = strtol(a[++i], &end, 10);
+			if (*end != '\0' || jobs < 1 || jobs > 1024) {
+				cout << "Invalid thread count \"" << a[i] << "\".\n";
+				return -1;
+			}
+			opts.jobs = jobs;
+			continue;
+		}
+		//single letter options can be grouped, as in "-ls".
+		for (char* c = a[i] + 1; *c; c++) {
+			if (*c == 'l')
+				opts.longFormat = true;
+			else if (*c == 's')
+				opts.sorted = true;
+			else if (*c == 'R')
+				opts.recursive = true;
+			else if (*c == 'u')
+				opts.unordered = true;
+			else if (*c == '0')
+				opts.format = FORMAT_NUL;
+			else {
+				cout << "Unknown option \"" << a[i] << "\".\n";
+				cout << "Usage: list [-l] [-s] [--json | -0] [-R [-u] [-j <threads>]] [<directory>]\n";
+				return -1;
+			}
+		}
+	}
+	return i;
+}
+
+commandTable extraCommands;
+
+int builtinIndex(string_view name) {
+	int8_t slot = builtinDispatch.slots[commandHash(name, builtinDispatch.seed) & (DISPATCH_TABLE_SIZE - 1)];
+	return (slot >= 0 && builtinCommands[slot].name == name) ? slot : -1;
+}
+
+function findCommand(string_view name) {
+	int slot = builtinIndex(name);
+	if (slot >= 0)
+		return builtinCommands[slot].fn;
+	unordered_map<string_view, function>::iterator iter = extraCommands.entries.find(name);
+	if (iter != extraCommands.entries.end())
+		return iter->second;
+	//only the first use of a plugin's command pays for finding and loading it.
+	if (!loadCommandPlugin(name))
+		return NULL;
+	return extraCommands.entries[name];
+}
+
+bool registerCommand(string_view name, function fn) {
+	if (builtinIndex(name) >= 0)
+		return false;
+	unordered_map<string_view, function>::iterator iter = extraCommands.entries.find(name);
+	if (iter != extraCommands.entries.end()) {
+		iter->second = fn;
+		return true;
+	}
+	extraCommands.names.push_back(string(name));
+	extraCommands.entries[extraCommands.names.back()] = fn;
+	if (extraCommands.loadingPlugin != NULL)
+		extraCommands.owners[extraCommands.names.back()] = extraCommands.loadingPlugin;
+	return true;
+}
+
+bool runCommand(char** a, int len, bool piped, scratchArena &scratch) {
+	//a "|" anywhere on the line makes it a pipeline of run/tee stages,
+	//unless it is the command a prefix like time is given.
+	function fn = NULL;
+	if (piped && findCommand(a[0]) != time_cmd) {
+		runPipeline(a, len, scratch);
+		return true;
+	}
+	//Check if the command the user entered is a builtin or registered
+	if ((fn = findCommand(a[0])) != NULL) {
+		fn(a, len, scratch);
+		return true;
+	}
+	cout << "Unrecognized command: \"" << a[0] <<"\".\n";
+	cout << "Type \"help\" to view a list of valid commands.\n";
+	return false;
+}
+
+bool loadCommandPlugin(string_view name) {
+	if (extraCommands.missing.find(name) != extraCommands.missing.end())
+		return false;
+	//plugin files are named after a command, anything that could leave the
+	//directory isn't one.
+	bool valid = !name.empty() && name[0] != '.';
+	for (size_t i = 0; i < name.size() && valid; i++)
+		valid = isalnum((unsigned char)name[i]) || name[i] == '_' || name[i] == '-' || name[i] == '.';
+
+	const char* dirs = getenv("SMASH_PLUGIN_PATH");
+	string defaultDir;
+	if (dirs == NULL) {
+		const char* home = getenv("HOME");
+		defaultDir = string(home != NULL ? home : "") + PLUGIN_DEFAULT_DIR;
+		dirs = defaultDir.c_str();
+	}
+	while (valid && *dirs != '\0') {
+		const char* end = strchr(dirs, ':');
+		if (end == NULL)
+			end = dirs + strlen(dirs);
+		string path = string(dirs, end - dirs) + "/" + string(name) + ".so";
+		bool empty = end == dirs;
+		dirs = *end == ':' ? end + 1 : end;
+		if (empty || access(path.c_str(), R_OK) != 0)
+			continue;
+		if (loadPlugin(path) && extraCommands.entries.find(name) != extraCommands.entries.end())
+			return true;
+		break;
+	}
+	extraCommands.names.push_back(string(name));
+	extraCommands.missing[extraCommands.names.back()] = true;
+	return false;
+}
+
+bool loadPlugin(const string &path) {
+	for (size_t i = 0; i < extraCommands.plugins.size(); i++) {
+		if (extraCommands.plugins[i].second == path)
+			return true;
+	}
+#ifdef SMASH_NO_PLUGINS
+	//a static binary has no dynamic loader or C++ runtime to share with one.
+	cout << "Unable to load plugin \"" << path << "\": this smash was built without plugins.\n";
+	return false;
+#else
+	void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		cout << "Unable to load plugin: " << dlerror() << ".\n";
+		return false;
+	}
+	int (*init)(const smash_plugin_host*) = 
+		(int (*)(const smash_plugin_host*))dlsym(handle, SMASH_PLUGIN_INIT);
+	if (init == NULL) {
+		cout << "\"" << path << "\" is not a smash plugin.\n";
+		dlclose(handle);
+		return false;
+	}
+
+	static const smash_plugin_host host = { SMASH_PLUGIN_ABI_VERSION, pluginRegister };
+	extraCommands.plugins.push_back(make_pair(handle, path));
+	extraCommands.loadingPlugin = &extraCommands.plugins.back().second;
+	int result = init(&host);
+	extraCommands.loadingPlugin = NULL;
+	if (result != 0) {
+		//a failed plugin may still have registered commands, so it stays
+		//loaded rather than leaving them pointing at unmapped code.
+		cout << "Plugin \"" << path << "\" failed to initialise.\n";
+		return false;
+	}
+	return true;
+#endif
+}
+
+int pluginRegister(const char* name, smash_command fn) {
+	if (!registerCommand(name, pluginCommand))
+		return -1;
+	extraCommands.external[extraCommands.entries.find(name)->first] = fn;
+	//a plugin can make a command that was earlier found missing.
+	extraCommands.missing.erase(name);
+	return 0;
+}
+
+void pluginCommand(char** a, int len, scratchArena &scratch) {
+	unordered_map<string_view, smash_command>::iterator iter = extraCommands.external.find(a[0]);
+	if (iter != extraCommands.external.end())
+		iter->second(a, len);
+}
+
+bool createInStream(ifstream &iStream, const char fileName[]) {
+    iStream.open(fileName);
+    if (!iStream.good()) {
+        cout << "File \"" << fileName << "\" doesn't exist or has invalid permissions.\n";
+        cout << "Cannot continue requested operation.\n";
+        return false;
+    }
+    return true;
+}
+
+bool validateOutFile(const char fileName[]) {
+    //the stream only finds out if the file exists, so it doesn't need more
+    //than a byte of the stack as its buffer.
+    char unused;
+    ifstream stream;
+    stream.rdbuf()->pubsetbuf(&unused, 1);
+    stream.open(fileName);
+    //If stream is good, file already exists.
+    if (stream.good()) {
+    	stream.close();
+        if (session.overwrite == OVERWRITE_ALWAYS)
+            return true;
+        if (session.overwrite == OVERWRITE_NEVER) {
+            cout << "File \"" << fileName << "\" already exists, not overwriting it.\n";
+            return false;
+        }
+        //Warn user that file already exists and if they continue, it will be overwritten.
+        cout << "File \"" << fileName << "\" already exists.\n";
+        cout << "If you continue, this file will be overwritten.\n";
+        cout << "Do you wish to continue (y/n)? ";
+        //the answer comes from the same reader as the commands, so lines
+        //that were already buffered after this one stay queued.
+        string answer;
+        readAnswer(input, answer);
+        string_view userInput(answer);
+        while (!userInput.empty() && isspace((unsigned char)userInput.back()))
+            userInput.remove_suffix(1);
+        while (!userInput.empty() && isspace((unsigned char)userInput.front()))
+            userInput.remove_prefix(1);
+        if (userInput != "y") {
+        	cout << "Operation aborted.\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool createOutStream(ofstream &oStream, const char fileName[]) {
+    oStream.open(fileName);
+    if (!oStream.good()) {
+        cout << "Unknown error creating output file\"" << fileName << "\".\n";
+        cout << "Cannot continue requested operation.\n";
+        return false;
+    }
+    return true;
+}
+
+
+
+// -- Output Sink --
+
+void outputSink::write(const char* s, size_t n) {
+	if (capturedOutput != NULL) {
+		capturedOutput->insert(capturedOutput->end(), s, s + n);
+		return;
+	}
+	unique_lock<mutex> guard(lock);
+	while (n > 0) {
+		size_t space = SINK_BUFFER_SIZE - (head - tail);
+		if (space == 0) {
+			//a full ring waits for the writer thread, or is written by
+			//whichever thread filled it.
+			if (threaded) {
+				changed.notify_all();
+				changed.wait(guard);
+			}
+			else {
+				drain(guard);
+			}
+			continue;
+		}
+		size_t start = head % SINK_BUFFER_SIZE;
+		size_t run = min(min(n, space), SINK_BUFFER_SIZE - start);
+		memcpy(ring + start, s, run);
+		head += run;
+		s += run;
+		n -= run;
+	}
+	if (head - tail >= SINK_FLUSH_THRESHOLD) {
+		if (threaded)
+			changed.notify_all();
+		else
+			drain(guard);
+	}
+}
+
+void outputSink::flush() {
+	//captured output is printed by parallel, in order.
+	if (capturedOutput != NULL)
+		return;
+	unique_lock<mutex> guard(lock);
+	size_t target = head;
+	if (threaded) {
+		flushTarget = max(flushTarget, target);
+		changed.notify_all();
+		while (tail < target)
+			changed.wait(guard);
+		return;
+	}
+	while (tail < target)
+		drain(guard);
+}
+
+void outputSink::drain(unique_lock<mutex> &guard) {
+	while (writing)
+		changed.wait(guard);
+	if (tail == head)
+		return;
+	writing = true;
+	size_t start = tail;
+	size_t end = head;
+	guard.unlock();
+
+	//the bytes can wrap around the end of the ring, then they are two pieces.
+	iovec pieces[2];
+	int count = 1;
+	size_t first = start % SINK_BUFFER_SIZE;
+	pieces[0].iov_base = ring + first;
+	pieces[0].iov_len = min(end - start, SINK_BUFFER_SIZE - first);
+	if (pieces[0].iov_len < end - start) {
+		pieces[1].iov_base = ring;
+		pieces[1].iov_len = end - start - pieces[0].iov_len;
+		count = 2;
+	}
+	for (int i = 0; i < count; ) {
+		ssize_t m = writev(fd, pieces + i, count - i);
+		if (m == -1 && errno == EINTR)
+			continue;
+		//output that can't be written is dropped, as cout would.
+		if (m == -1)
+			break;
+		while (i < count && (size_t)m >= pieces[i].iov_len)
+			m -= pieces[i++].iov_len;
+		if (i < count) {
+			pieces[i].iov_base = (char*)pieces[i].iov_base + m;
+			pieces[i].iov_len -= m;
+		}
+	}
+
+	guard.lock();
+	tail = end;
+	writing = false;
+	changed.notify_all();
+}
+
+void outputSink::writerLoop() {
+	unique_lock<mutex> guard(lock);
+	while (true) {
+		//small amounts are still written after SINK_LATENCY_MS.
+		if (!stopping && head - tail < SINK_FLUSH_THRESHOLD && tail >= flushTarget)
+			changed.wait_for(guard, chrono::milliseconds(SINK_LATENCY_MS));
+		if (head != tail)
+			drain(guard);
+		else if (stopping)
+			break;
+	}
+}
+
+void outputSink::start() {
+	lock_guard<mutex> guard(lock);
+	if (threaded)
+		return;
+	threaded = true;
+	writer = thread(&outputSink::writerLoop, this);
+}
+
+void outputSink::stop() {
+	unique_lock<mutex> guard(lock);
+	if (!threaded) {
+		guard.unlock();
+		flush();
+		return;
+	}
+	stopping = true;
+	changed.notify_all();
+	guard.unlock();
+	writer.join();
+	guard.lock();
+	threaded = false;
+	stopping = false;
+}
+
+streamsize outputSink::xsputn(const char* s, streamsize n) {
+	write(s, n);
+	return n;
+}
+
+int outputSink::overflow(int c) {
+	if (c != EOF) {
+		char ch = c;
+		write(&ch, 1);
+	}
+	return traits_type::not_eof(c);
+}
+
+int outputSink::sync() {
+	flush();
+	return 0;
+}
+
+//holds cout's own buffer, put back at exit since cout is flushed once more
+//	after the sink is gone.
+static streambuf* coutBuffer = NULL;
+
+void initOutput(bool threaded) {
+	static bool registered = false;
+	streambuf* previous = cout.rdbuf(&stdoutSink);
+	if (previous != &stdoutSink)
+		coutBuffer = previous;
+	//nothing reads cin, the prompt flushes on its own.
+	cin.tie(NULL);
+	if (threaded)
+		stdoutSink.start();
+	if (!registered) {
+		registered = true;
+		atexit(finishOutput);
+	}
+}
+
+void finishOutput() {
+	stdoutSink.stop();
+	if (coutBuffer != NULL)
+		cout.rdbuf(coutBuffer);
+}
+
+// -- Copy Engine --
+
+bool copyFileData(int inFd, int outFd, off_t size) {
+	copyResult result = COPY_UNSUPPORTED;
+	off_t offset = 0;
+
+	//the kernel-side stages need a known size, since some special files 
+	//(procfs, sysfs) report a size of 0 and copy_file_range would stop early.
+	if (size > 0) {
+		result = reflinkCopy(inFd, outFd);
+		//a reflink shares the holes too, otherwise only the data is copied.
+		if (result == COPY_UNSUPPORTED && hasHoles(inFd, size))
+			result = sparseCopy(inFd, outFd, size);
+		if (result == COPY_UNSUPPORTED)
+			result = rangeCopy(inFd, outFd, offset, size);
+		if (result == COPY_UNSUPPORTED)
+			result = sendfileCopy(inFd, outFd, offset, size);
+		if (result == COPY_UNSUPPORTED)
+			result = mmapCopy(inFd, outFd, offset, size);
+	}
+	if (result == COPY_UNSUPPORTED)
+		result = spliceCopy(inFd, outFd, offset);
+	if (result == COPY_UNSUPPORTED)
+		result = bufferCopy(inFd, outFd, offset);
+
+	return result == COPY_DONE;
+}
+
+bool hasHoles(int fd, off_t size) {
+	struct stat st;
+	return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (off_t)st.st_blocks * 512 < size;
+}
+
+copyResult sparseCopy(int inFd, int outFd, off_t size) {
+	traceScope span("sparse_copy", size);
+	struct stat outStat;
+	if (fstat(outFd, &outStat) == -1 || !S_ISREG(outStat.st_mode))
+		return COPY_UNSUPPORTED;
+
+	off_t pos = 0;
+	while (pos < size) {
+		off_t data = lseek(inFd, pos, SEEK_DATA);
+		if (data == -1 && errno == ENXIO)
+			data = size;
+		else if (data == -1)
+			return pos == 0 ? COPY_UNSUPPORTED : COPY_FAILED;
+		if (data > size)
+			data = size;
+
+		//an empty destination already reads as zeros past what was written,
+		//only blocks it had before need to be given back.
+		if (data > pos && pos < outStat.st_size) {
+			off_t end = (data < outStat.st_size) ? data : outStat.st_size;
+			if (fallocate(outFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, end - pos) == -1) {
+				//without hole punching the zeros have to be written.
+				char zeros[4096] = {};
+				for (off_t z = pos; z < end; z += sizeof(zeros)) {
+					size_t n = (end - z > (off_t)sizeof(zeros)) ? sizeof(zeros) : end - z;
+					if (pwrite(outFd, zeros, n, z) != (ssize_t)n)
+						return COPY_FAILED;
+				}
+			}
+		}
+		if (data == size)
+			break;
+
+		off_t hole = lseek(inFd, data, SEEK_HOLE);
+		if (hole == -1 || hole > size)
+			hole = size;
+		pos = data;
+		copyResult result = extentCopy(inFd, outFd, pos, hole);
+		if (result != COPY_DONE)
+			return result;
+	}
+	//the size has to be set for a hole at the end of the file.
+	return ftruncate(outFd, size) == 0 ? COPY_DONE : COPY_FAILED;
+}
+
+copyResult extentCopy(int inFd, int outFd, off_t &offset, off_t end) {
+	copyResult result = rangeCopy(inFd, outFd, offset, end);
+	if (result == COPY_UNSUPPORTED)
+		result = sendfileCopy(inFd, outFd, offset, end);
+	if (result != COPY_UNSUPPORTED)
+		return result;
+
+	char* buffer = new char[COPY_BUFFER_SIZE];
+	result = COPY_DONE;
+	while (offset < end && result == COPY_DONE) {
+		size_t want = (end - offset > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : end - offset;
+		ssize_t n = pread(inFd, buffer, want, offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0 || !writeAllAt(outFd, buffer, n, offset)) {
+			result = COPY_FAILED;
+			break;
+		}
+		offset += n;
+	}
+	delete [] buffer;
+	return result;
+}
+
+copyResult reflinkCopy(int inFd, int outFd) {
+	traceScope span("reflink");
+#ifdef FICLONE
+	if (ioctl(outFd, FICLONE, inFd) == 0)
+		return COPY_DONE;
+#endif
+	//any error (EXDEV, EOPNOTSUPP, EINVAL...) just means we can't share extents.
+	return COPY_UNSUPPORTED;
+}
+
+copyResult rangeCopy(int inFd, int outFd, off_t &offset, off_t size) {
+	traceScope span("copy_file_range", size - offset);
+	while (offset < size) {
+		loff_t inOff = offset, outOff = offset;
+		size_t count = (size - offset > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : size - offset;
+		ssize_t n = copy_file_range(inFd, &inOff, outFd, &outOff, count, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			//these mean copy_file_range can't handle this pair of files
+			//(cross filesystem on old kernels, FUSE/NFS without support...).
+			if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || 
+				errno == EINVAL || errno == EBADF || errno == EPERM)
+				return COPY_UNSUPPORTED;
+			return COPY_FAILED;
+		}
+		//the file shrank or the filesystem refuses to copy any further.
+		if (n == 0)
+			return COPY_UNSUPPORTED;
+		offset += n;
+	}
+	return COPY_DONE;
+}
+
+copyResult sendfileCopy(int inFd, int outFd, off_t &offset, off_t size) {
+	traceScope span("sendfile", size - offset);
+	//sendfile writes at the output's file position, so line it up with ours.
+	if (lseek(outFd, offset, SEEK_SET) == -1)
+		return COPY_UNSUPPORTED;
+	while (offset < size) {
+		size_t count = (size - offset > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : size - offset;
+		ssize_t n = sendfile(outFd, inFd, &offset, count);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+				return COPY_UNSUPPORTED;
+			return COPY_FAILED;
+		}
+		if (n == 0)
+			return COPY_UNSUPPORTED;
+	}
+	return COPY_DONE;
+}
+
+copyResult mmapCopy(int inFd, int outFd, off_t &offset, off_t size) {
+	traceScope span("mmap_copy", size - offset);
+	struct stat st;
+	if (fstat(inFd, &st) == -1 || !S_ISREG(st.st_mode) || offset >= size)
+		return COPY_UNSUPPORTED;
+	posix_fadvise(inFd, offset, size - offset, POSIX_FADV_SEQUENTIAL);
+
+	while (offset < size) {
+		//windows start on a huge page boundary below 'offset', so the
+		//mapping can use huge pages where the filesystem supports them.
+		off_t start = offset & ~((off_t)MMAP_ALIGN - 1);
+		size_t length = (size - start > MMAP_WINDOW_SIZE) ? MMAP_WINDOW_SIZE : size - start;
+		//pages past the end of a file that shrank can't be read, so a
+		//	source truncated meanwhile is left to the stages that just see
+		//	a short read.
+		if (fstat(inFd, &st) == -1 || st.st_size < start + (off_t)length)
+			return COPY_UNSUPPORTED;
+		char* map = (char*)mmap(NULL, length, PROT_READ, MAP_SHARED, inFd, start);
+		if (map == MAP_FAILED)
+			return COPY_UNSUPPORTED;
+		madvise(map, length, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+		madvise(map, length, MADV_HUGEPAGE);
+#endif
+
+		//write-ahead, the first write lines the rest up on MMAP_ALIGN.
+		off_t windowEnd = start + length;
+		off_t copiedFrom = offset;
+		while (offset < windowEnd) {
+			off_t next = (offset & ~((off_t)MMAP_ALIGN - 1)) + MMAP_ALIGN;
+			if (next > windowEnd)
+				next = windowEnd;
+			if (!writeAllAt(outFd, map + (offset - start), next - offset, offset)) {
+				//the write faults on the pages the file lost during this
+				//	window, the file is then finished without the mapping.
+				int err = errno;
+				munmap(map, length);
+				if (err == EFAULT && fstat(inFd, &st) == 0 && st.st_size < windowEnd)
+					return COPY_UNSUPPORTED;
+				errno = err;
+				return COPY_FAILED;
+			}
+			offset = next;
+		}
+		munmap(map, length);
+		dropCopiedPages(inFd, outFd, copiedFrom, windowEnd, size);
+	}
+	return COPY_DONE;
+}
+
+void dropCopiedPages(int inFd, int outFd, off_t start, off_t end, off_t size) {
+	if (size <= CACHE_DROP_THRESHOLD)
+		return;
+	//the source pages are clean and can go right away.
+	posix_fadvise(inFd, start, end - start, POSIX_FADV_DONTNEED);
+	//dirty pages stay cached until they are written, so start writing this
+	//window back and only drop the one before it, which has had the time
+	//of a whole window to finish.
+	sync_file_range(outFd, start, end - start, SYNC_FILE_RANGE_WRITE);
+	off_t previous = start - MMAP_WINDOW_SIZE;
+	if (previous < 0)
+		return;
+	sync_file_range(outFd, previous, MMAP_WINDOW_SIZE, SYNC_FILE_RANGE_WAIT_BEFORE | 
+		SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(outFd, previous, MMAP_WINDOW_SIZE, POSIX_FADV_DONTNEED);
+}
+
+copyResult spliceCopy(int inFd, int outFd, off_t &offset) {
+	traceScope span("splice");
+	int p[2];
+	if (pipe2(p, O_CLOEXEC) == -1)
+		return COPY_UNSUPPORTED;
+	//a larger pipe means fewer round trips through the two splice calls.
+	fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+	//splice needs the offsets to be NULL for pipes and non-seekable files.
+	bool seekIn = lseek(inFd, 0, SEEK_CUR) != -1;
+	bool seekOut = lseek(outFd, 0, SEEK_CUR) != -1;
+	copyResult result = COPY_DONE;
+	while (true) {
+		loff_t inOff = offset;
+		ssize_t n = splice(inFd, seekIn ? &inOff : NULL, p[1], NULL, 
+			SPLICE_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			//nothing is left in the pipe, so a plain read/write can take over.
+			result = (errno == EINVAL || errno == ENOSYS) ? COPY_UNSUPPORTED : COPY_FAILED;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		//drain everything that was put in the pipe to the output file.
+		ssize_t left = n;
+		while (left > 0) {
+			loff_t outOff = offset + (n - left);
+			ssize_t m = splice(p[0], NULL, outFd, seekOut ? &outOff : NULL, 
+				left, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m == -1 && errno == EINTR)
+				continue;
+			if (m <= 0) {
+				//data is stuck in the pipe, it can't be handed to another stage.
+				result = COPY_FAILED;
+				break;
+			}
+			left -= m;
+		}
+		if (result == COPY_FAILED)
+			break;
+		offset += n;
+	}
+
+	int savedErrno = errno;
+	close(p[0]);
+	close(p[1]);
+	errno = savedErrno;
+	return result;
+}
+
+copyResult bufferCopy(int inFd, int outFd, off_t &offset) {
+	traceScope span("read_write");
+	char* buffer = new char[COPY_BUFFER_SIZE];
+	bool seekIn = lseek(inFd, 0, SEEK_CUR) != -1;
+	bool seekOut = lseek(outFd, 0, SEEK_CUR) != -1;
+	copyResult result = COPY_DONE;
+	while (true) {
+		ssize_t n = seekIn ? pread(inFd, buffer, COPY_BUFFER_SIZE, offset) :
+			read(inFd, buffer, COPY_BUFFER_SIZE);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == -1)
+				result = COPY_FAILED;
+			break;
+		}
+		for (ssize_t done = 0; done < n; ) {
+			ssize_t m = seekOut ? pwrite(outFd, buffer + done, n - done, offset + done) :
+				write(outFd, buffer + done, n - done);
+			if (m == -1 && errno == EINTR)
+				continue;
+			if (m == -1) {
+				result = COPY_FAILED;
+				break;
+			}
+			done += m;
+		}
+		if (result == COPY_FAILED)
+			break;
+		offset += n;
+	}
+
+	int savedErrno = errno;
+	delete [] buffer;
+	errno = savedErrno;
+	return result;
+}
+
+bool parallelCopy(int inFd, int outFd, off_t size, int jobs) {
+	//reserve all of the destination's blocks up front so the threads writing
+	//at different offsets don't fragment it. filesystems without fallocate
+	//still need the final size so every pwrite lands inside the file.
+	//a sparse source only gets its size, the holes stay unallocated.
+	bool sparse = hasHoles(inFd, size);
+	if ((sparse || fallocate(outFd, 0, 0, size) == -1) && ftruncate(outFd, size) == -1)
+		return false;
+
+	atomic<off_t> nextOffset(0);
+	atomic<off_t> copied(0);
+	atomic<int> running(jobs);
+	atomic<int> error(0);
+	mutex doneMutex;
+	condition_variable done;
+
+	//each thread keeps claiming the next free range until the file is done.
+	vector<thread> workers;
+	for (int t = 0; t < jobs; t++) {
+		workers.push_back(thread([&]() {
+			char* buffer = new char[COPY_BUFFER_SIZE];
+			off_t start;
+			while (!error && (start = nextOffset.fetch_add(PARALLEL_CHUNK_SIZE)) < size) {
+				off_t end = (start + PARALLEL_CHUNK_SIZE < size) ? start + PARALLEL_CHUNK_SIZE : size;
+				for (off_t pos = start; pos < end && !error; ) {
+					size_t want = (end - pos > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : end - pos;
+					if (sparse) {
+						//skip to the next data in the range, and stop at its hole.
+						off_t data = lseek(inFd, pos, SEEK_DATA);
+						if (data == -1 || data >= end) {
+							copied += end - pos;
+							break;
+						}
+						copied += data - pos;
+						pos = data;
+						off_t hole = lseek(inFd, pos, SEEK_HOLE);
+						if (hole != -1 && hole < end)
+							want = (hole - pos > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : hole - pos;
+						else
+							want = (end - pos > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : end - pos;
+					}
+					ssize_t n = pread(inFd, buffer, want, pos);
+					if (n == -1 && errno == EINTR)
+						continue;
+					//a source that shrank while copying is an error as well.
+					if (n <= 0) {
+						error = (n == 0) ? EIO : errno;
+						break;
+					}
+					for (ssize_t done = 0; done < n; ) {
+						ssize_t m = pwrite(outFd, buffer + done, n - done, pos + done);
+						if (m == -1 && errno == EINTR)
+							continue;
+						if (m == -1) {
+							error = errno;
+							break;
+						}
+						done += m;
+					}
+					pos += n;
+					copied += n;
+				}
+			}
+			delete [] buffer;
+			//wake the progress loop right away once the last range is written.
+			lock_guard<mutex> lock(doneMutex);
+			running--;
+			done.notify_one();
+		}));
+	}
+
+	//print the live throughput while the threads are copying.
+	bool live = isatty(STDOUT_FILENO);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	unique_lock<mutex> lock(doneMutex);
+	while (running > 0) {
+		done.wait_for(lock, chrono::milliseconds(PROGRESS_INTERVAL_MS));
+		if (live && running > 0) {
+			chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+			cout << "\r" << (copied * 100 / size) << "% ";
+			printThroughput(copied, elapsed.count());
+			cout << "   " << flush;
+		}
+	}
+	lock.unlock();
+	if (live)
+		cout << "\r";
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	if (error) {
+		errno = error;
+		return false;
+	}
+	return true;
+}
+
+alignedPool directBuffers;
+
+char* alignedPool::take() {
+	lock_guard<mutex> guard(lock);
+	if (!free.empty()) {
+		char* buffer = free.back();
+		free.pop_back();
+		return buffer;
+	}
+	void* buffer = NULL;
+	if (posix_memalign(&buffer, DIRECT_ALIGN, DIRECT_BLOCK_SIZE) != 0)
+		return NULL;
+	return (char*)buffer;
+}
+
+void alignedPool::give(char* buffer) {
+	lock_guard<mutex> guard(lock);
+	free.push_back(buffer);
+}
+
+copyResult directCopy(int inFd, int outFd, off_t size, int depth) {
+	traceScope span("direct_copy", size);
+	int inFlags = fcntl(inFd, F_GETFL);
+	int outFlags = fcntl(outFd, F_GETFL);
+	if (fcntl(inFd, F_SETFL, inFlags | O_DIRECT) == -1 || 
+		fcntl(outFd, F_SETFL, outFlags | O_DIRECT) == -1) {
+		fcntl(inFd, F_SETFL, inFlags);
+		return COPY_UNSUPPORTED;
+	}
+	//the last block is written padded to DIRECT_ALIGN, so reserve that much.
+	off_t padded = (size + DIRECT_ALIGN - 1) & ~((off_t)DIRECT_ALIGN - 1);
+	if (fallocate(outFd, 0, 0, padded) == -1 && ftruncate(outFd, padded) == -1) {
+		int err = errno;
+		fcntl(inFd, F_SETFL, inFlags);
+		fcntl(outFd, F_SETFL, outFlags);
+		errno = err;
+		return COPY_FAILED;
+	}
+
+	//each worker is one request in flight. the blocks are claimed in order,
+	//so the device sees mostly sequential I/O at queue depth 'depth'.
+	atomic<off_t> nextOffset(0);
+	atomic<int> error(0);
+	atomic<bool> unsupported(false);
+	vector<thread> workers;
+	for (int t = 0; t < depth; t++) {
+		workers.push_back(thread([&]() {
+			char* buffer = directBuffers.take();
+			if (buffer == NULL) {
+				error = ENOMEM;
+				return;
+			}
+			off_t pos;
+			while (!error && (pos = nextOffset.fetch_add(DIRECT_BLOCK_SIZE)) < size) {
+				size_t want = (size - pos > DIRECT_BLOCK_SIZE) ? DIRECT_BLOCK_SIZE : 
+					(size - pos + DIRECT_ALIGN - 1) & ~((size_t)DIRECT_ALIGN - 1);
+				ssize_t n;
+				do {
+					n = pread(inFd, buffer, want, pos);
+				} while (n == -1 && errno == EINTR);
+				if (n <= 0) {
+					//EINVAL on the first block means the filesystem takes the
+					//flag but not our alignment.
+					if (n == -1 && errno == EINVAL && pos == 0)
+						unsupported = true;
+					error = (n == 0) ? EIO : errno;
+					break;
+				}
+				//a short read is the end of the file, padded with zeros to an
+				//aligned length that ftruncate cuts off again.
+				size_t length = ((size_t)n + DIRECT_ALIGN - 1) & ~((size_t)DIRECT_ALIGN - 1);
+				memset(buffer + n, 0, length - n);
+				if (!writeAllAt(outFd, buffer, length, pos)) {
+					if (errno == EINVAL && pos == 0)
+						unsupported = true;
+					error = errno;
+				}
+			}
+			directBuffers.give(buffer);
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	fcntl(inFd, F_SETFL, inFlags);
+	fcntl(outFd, F_SETFL, outFlags);
+	if (unsupported) {
+		//start over on the regular path with an empty destination.
+		ftruncate(outFd, 0);
+		return COPY_UNSUPPORTED;
+	}
+	if (error) {
+		errno = error;
+		return COPY_FAILED;
+	}
+	return ftruncate(outFd, size) == 0 ? COPY_DONE : COPY_FAILED;
+}
+
+bool deltaCopy(int inFd, int outFd, off_t size, int jobs, off_t &changed) {
+	//a longer destination loses its tail, a shorter one reads as zeros past
+	//its old end, which only matches where the source is zero as well.
+	struct stat outStat;
+	if (fstat(outFd, &outStat) == -1)
+		return false;
+	if (outStat.st_size != size && ftruncate(outFd, size) == -1)
+		return false;
+	posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(outFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	atomic<off_t> nextOffset(0);
+	atomic<off_t> written(0);
+	atomic<int> error(0);
+	vector<thread> workers;
+	for (int t = 0; t < jobs; t++) {
+		workers.push_back(thread([&]() {
+			char* source = new char[DELTA_READ_SIZE];
+			char* target = new char[DELTA_READ_SIZE];
+			off_t start;
+			while (!error && (start = nextOffset.fetch_add(DELTA_READ_SIZE)) < size) {
+				size_t want = (size - start > DELTA_READ_SIZE) ? DELTA_READ_SIZE : size - start;
+				ssize_t n = 0;
+				ssize_t m = 0;
+				while ((n = pread(inFd, source, want, start)) == -1 && errno == EINTR)
+					;
+				while ((m = pread(outFd, target, want, start)) == -1 && errno == EINTR)
+					;
+				//a source that shrank while copying is an error.
+				if (n != (ssize_t)want || m == -1) {
+					error = (n == -1 || m == -1) ? errno : EIO;
+					break;
+				}
+				//only the blocks that differ are written, a run of them in
+				//one pwrite. both are in memory, so they are compared as
+				//they are, a checksum would cost more and could collide.
+				size_t run = 0;
+				size_t runLength = 0;
+				for (size_t pos = 0; pos < want && !error; pos += DELTA_BLOCK_SIZE) {
+					size_t block = (want - pos > DELTA_BLOCK_SIZE) ? DELTA_BLOCK_SIZE : want - pos;
+					bool same = pos + block <= (size_t)m && 
+						memcmp(source + pos, target + pos, block) == 0;
+					if (!same) {
+						if (runLength == 0)
+							run = pos;
+						runLength += block;
+					}
+					if ((same || pos + block == want) && runLength > 0) {
+						if (!writeAllAt(outFd, source + run, runLength, start + run))
+							error = errno;
+						written += runLength;
+						runLength = 0;
+					}
+				}
+			}
+			delete [] source;
+			delete [] target;
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	changed = written;
+	if (error) {
+		errno = error;
+		return false;
+	}
+	return true;
+}
+
+void printThroughput(off_t bytes, double seconds) {
+	double mb = bytes / (1024.0 * 1024.0);
+	cout << mb << " MB";
+	if (seconds > 0)
+		cout << " (" << mb / seconds << " MB/s)";
+}
+
+void copyQueue::push(const copyTask &task) {
+	unique_lock<mutex> guard(lock);
+	while (tasks.size() >= COPY_QUEUE_SIZE)
+		notFull.wait(guard);
+	tasks.push_back(task);
+	notEmpty.notify_one();
+}
+
+bool copyQueue::pop(vector<copyTask> &out, size_t max) {
+	out.clear();
+	unique_lock<mutex> guard(lock);
+	while (tasks.empty() && !closed)
+		notEmpty.wait(guard);
+	while (!tasks.empty() && out.size() < max) {
+		out.push_back(tasks.front());
+		tasks.pop_front();
+	}
+	notFull.notify_all();
+	return !out.empty();
+}
+
+void copyQueue::close() {
+	lock_guard<mutex> guard(lock);
+	closed = true;
+	notEmpty.notify_all();
+}
+
+void treeCopyStats::copied(off_t size) {
+	files++;
+	bytes += size;
+}
+
+void treeCopyStats::error(const char* path, int err) {
+	failed++;
+	lock_guard<mutex> guard(errorLock);
+	cout << "Error copying \"" << path << "\": " << strerror(err) << ".\n";
+}
+
+void treeCopy(const char* src, const char* dst, int jobs) {
+	if (jobs == 0) {
+		jobs = thread::hardware_concurrency();
+		if (jobs < 1)
+			jobs = 1;
+	}
+
+	//an existing destination is merged into, but only after the user agrees.
+	struct stat dstStat;
+	if (stat(dst, &dstStat) == 0) {
+		if (!S_ISDIR(dstStat.st_mode)) {
+			cout << "\"" << dst << "\" is not a directory.\n";
+			return;
+		}
+		if (!validateOutFile(dst))
+			return;
+	}
+	else if (mkdir(dst, S_IRWXU | S_IRWXG | S_IRWXO) == -1) {
+		cout << "Unable to create directory \"" << dst << "\": " << strerror(errno) << ".\n";
+		return;
+	}
+
+	int srcRootFd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int dstRootFd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (srcRootFd == -1 || dstRootFd == -1 || fstat(dstRootFd, &dstStat) == -1) {
+		cout << "Unable to open \"" << src << "\" or \"" << dst << "\": " 
+			 << strerror(errno) << ".\n";
+		if (srcRootFd != -1)
+			close(srcRootFd);
+		if (dstRootFd != -1)
+			close(dstRootFd);
+		return;
+	}
+
+	copyQueue queue;
+	treeCopyStats stats;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	//the copier threads open every file relative to the two roots and move
+	//it with the same engine as a single file copy.
+	vector<thread> workers;
+	for (int t = 0; t < jobs; t++) {
+		workers.push_back(thread([&]() {
+			//every copier gets its own ring, when one can't be created the
+			//thread falls back to one POSIX copy at a time.
+			uringQueue ring;
+			bool batched = uringAvailable() && uringSetup(ring, URING_ENTRIES);
+			vector<copyTask> tasks;
+			while (queue.pop(tasks, batched ? URING_BATCH_FILES : 1)) {
+				if (batched)
+					uringCopyFiles(ring, srcRootFd, dstRootFd, tasks, stats);
+				else
+					copyTreeFile(srcRootFd, dstRootFd, tasks[0].path.c_str(), stats);
+			}
+			if (batched)
+				uringTeardown(ring);
+		}));
+	}
+
+	walkCopyTree(srcRootFd, dstRootFd, dup(srcRootFd), "", dstStat, queue, stats);
+	queue.close();
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+	close(srcRootFd);
+	close(dstRootFd);
+
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	cout << "Copied " << stats.files << " files in " << stats.dirs << " directories, ";
+	printThroughput(stats.bytes, elapsed.count());
+	cout << " in " << elapsed.count() << "s";
+	if (elapsed.count() > 0)
+		cout << " (" << stats.files / elapsed.count() << " files/s)";
+	cout << ".\n";
+	if (stats.failed > 0)
+		cout << stats.failed << " entries could not be copied.\n";
+}
+
+void copyTreeFile(int srcRootFd, int dstRootFd, const char* path, treeCopyStats &stats) {
+	struct stat inStat;
+	int outFd = -1;
+	int inFd = openat(srcRootFd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (inFd != -1 && fstat(inFd, &inStat) == 0)
+		outFd = openat(dstRootFd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 
+			inStat.st_mode & 07777);
+	bool ok = outFd != -1 && copyFileData(inFd, outFd, inStat.st_size);
+	int savedErrno = errno;
+	if (inFd != -1)
+		close(inFd);
+	if (outFd != -1)
+		close(outFd);
+	if (ok)
+		stats.copied(inStat.st_size);
+	else
+		stats.error(path, savedErrno);
+}
+
+void walkCopyTree(int srcRootFd, int dstRootFd, int srcDirFd, const string &relPath,
+	const struct stat &dstRootStat, copyQueue &queue, treeCopyStats &stats) {
+	//fdopendir takes ownership of 'srcDirFd', closedir will close it.
+	DIR* dp = fdopendir(srcDirFd);
+	if (dp == NULL) {
+		close(srcDirFd);
+		stats.failed++;
+		return;
+	}
+
+	struct dirent* ep;
+	while ((ep = readdir(dp))) {
+		const char* name = ep->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		string path = relPath.empty() ? string(name) : relPath + "/" + name;
+
+		//d_type saves a stat for each file, the copier threads fstat the files
+		//they open anyway. directories need their mode and inode here.
+		unsigned char type = ep->d_type;
+		struct stat st;
+		if (type == DT_UNKNOWN || type == DT_DIR) {
+			if (fstatat(dirfd(dp), name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+				stats.failed++;
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG :
+				S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR) {
+			//never descend into the destination when it is inside the source.
+			if (st.st_dev == dstRootStat.st_dev && st.st_ino == dstRootStat.st_ino)
+				continue;
+			//the directory exists before any of its files are queued, so the
+			//copier threads can create them right away.
+			if (mkdirat(dstRootFd, path.c_str(), (st.st_mode & 07777) | S_IRWXU) == -1 && 
+				errno != EEXIST) {
+				stats.failed++;
+				continue;
+			}
+			int childFd = openat(dirfd(dp), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (childFd == -1) {
+				stats.failed++;
+				continue;
+			}
+			stats.dirs++;
+			walkCopyTree(srcRootFd, dstRootFd, childFd, path, dstRootStat, queue, stats);
+		}
+		else if (type == DT_REG) {
+			copyTask task;
+			task.path = path;
+			queue.push(task);
+		}
+		else if (type == DT_LNK) {
+			char target[PATH_MAX];
+			ssize_t n = readlinkat(dirfd(dp), name, target, sizeof(target) - 1);
+			if (n == -1) {
+				stats.failed++;
+				continue;
+			}
+			target[n] = '\0';
+			unlinkat(dstRootFd, path.c_str(), 0);
+			if (symlinkat(target, dstRootFd, path.c_str()) == -1)
+				stats.failed++;
+		}
+		else {
+			//devices, fifos and sockets are not copied.
+			stats.failed++;
+		}
+	}
+	closedir(dp);
+}
+
+
+// -- Checksums --
+
+//the default secret of XXH3.
+static const unsigned char xxh3Secret[XXH3_SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static const uint64_t XXH_PRIME32_1 = 0x9E3779B1u;
+static const uint64_t XXH_PRIME32_2 = 0x85EBCA77u;
+static const uint64_t XXH_PRIME32_3 = 0xC2B2AE3Du;
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ull;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ull;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ull;
+static const uint64_t XXH_PRIME_MX1 = 0x165667919E3779F9ull;
+static const uint64_t XXH_PRIME_MX2 = 0x9FB21C651E98DF25ull;
+
+static inline uint64_t readLE64(const unsigned char* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t readLE32(const unsigned char* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t rotl64(uint64_t v, int r) {
+	return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t mulFold64(uint64_t a, uint64_t b) {
+	unsigned __int128 product = (unsigned __int128)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t xxh64Avalanche(uint64_t h) {
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3Avalanche(uint64_t h) {
+	h ^= h >> 37;
+	h *= XXH_PRIME_MX1;
+	return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3Mix16(const unsigned char* input, const unsigned char* secret) {
+	return mulFold64(readLE64(input) ^ readLE64(secret), readLE64(input + 8) ^ readLE64(secret + 8));
+}
+
+//the hash of inputs of up to 16 bytes.
+static uint64_t xxh3Short(const unsigned char* input, size_t length) {
+	const unsigned char* secret = xxh3Secret;
+	if (length > 8) {
+		uint64_t bitflip1 = readLE64(secret + 24) ^ readLE64(secret + 32);
+		uint64_t bitflip2 = readLE64(secret + 40) ^ readLE64(secret + 48);
+		uint64_t lo = readLE64(input) ^ bitflip1;
+		uint64_t hi = readLE64(input + length - 8) ^ bitflip2;
+		uint64_t acc = length + __builtin_bswap64(lo) + hi + mulFold64(lo, hi);
+		return xxh3Avalanche(acc);
+	}
+	if (length >= 4) {
+		uint64_t bitflip = readLE64(secret + 8) ^ readLE64(secret + 16);
+		uint64_t input64 = readLE32(input + length - 4) + ((uint64_t)readLE32(input) << 32);
+		uint64_t h = input64 ^ bitflip;
+		h ^= rotl64(h, 49) ^ rotl64(h, 24);
+		h *= XXH_PRIME_MX2;
+		h ^= (h >> 35) + length;
+		h *= XXH_PRIME_MX2;
+		return h ^ (h >> 28);
+	}
+	if (length > 0) {
+		uint32_t combined = ((uint32_t)input[0] << 16) | ((uint32_t)input[length >> 1] << 24) | 
+			input[length - 1] | ((uint32_t)length << 8);
+		uint64_t bitflip = readLE32(secret) ^ readLE32(secret + 4);
+		return xxh64Avalanche(combined ^ bitflip);
+	}
+	return xxh64Avalanche(readLE64(secret + 56) ^ readLE64(secret + 64));
+}
+
+//the hash of inputs of 17 to 240 bytes.
+static uint64_t xxh3Medium(const unsigned char* input, size_t length) {
+	const unsigned char* secret = xxh3Secret;
+	uint64_t acc = length * XXH_PRIME64_1;
+	if (length <= 128) {
+		if (length > 32) {
+			if (length > 64) {
+				if (length > 96) {
+					acc += xxh3Mix16(input + 48, secret + 96);
+					acc += xxh3Mix16(input + length - 64, secret + 112);
+				}
+				acc += xxh3Mix16(input + 32, secret + 64);
+				acc += xxh3Mix16(input + length - 48, secret + 80);
+			}
+			acc += xxh3Mix16(input + 16, secret + 32);
+			acc += xxh3Mix16(input + length - 32, secret + 48);
+		}
+		acc += xxh3Mix16(input, secret);
+		acc += xxh3Mix16(input + length - 16, secret + 16);
+		return xxh3Avalanche(acc);
+	}
+	size_t rounds = length / 16;
+	for (size_t i = 0; i < 8; i++)
+		acc += xxh3Mix16(input + 16 * i, secret + 16 * i);
+	acc = xxh3Avalanche(acc);
+	for (size_t i = 8; i < rounds; i++)
+		acc += xxh3Mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+	acc += xxh3Mix16(input + length - 16, secret + XXH3_MIDSIZE_SECRET - 17);
+	return xxh3Avalanche(acc);
+}
+
+static void xxh3AccumulateScalar(uint64_t* acc, const unsigned char* input, 
+	const unsigned char* secret, size_t stripes) {
+	for (size_t s = 0; s < stripes; s++) {
+		const unsigned char* in = input + s * XXH3_STRIPE_LEN;
+		const unsigned char* key = secret + s * 8;
+		for (int i = 0; i < 8; i++) {
+			uint64_t data = readLE64(in + 8 * i);
+			uint64_t keyed = data ^ readLE64(key + 8 * i);
+			acc[i ^ 1] += data;
+			acc[i] += (keyed & 0xFFFFFFFFu) * (keyed >> 32);
+		}
+	}
+}
+
+#if defined(__x86_64__)
+//each 64 bit lane gets the product of its keyed halves and the data of its
+//	neighbour, the shuffle swaps the 64 bit halves of every 128 bit lane.
+__attribute__((target("sse2")))
+static void xxh3AccumulateSse2(uint64_t* acc, const unsigned char* input, 
+	const unsigned char* secret, size_t stripes) {
+	__m128i* a = (__m128i*)acc;
+	__m128i lanes[4] = { _mm_loadu_si128(a), _mm_loadu_si128(a + 1), 
+		_mm_loadu_si128(a + 2), _mm_loadu_si128(a + 3) };
+	for (size_t s = 0; s < stripes; s++) {
+		for (int i = 0; i < 4; i++) {
+			__m128i data = _mm_loadu_si128((const __m128i*)(input + s * XXH3_STRIPE_LEN) + i);
+			__m128i key = _mm_loadu_si128((const __m128i*)(secret + s * 8) + i);
+			__m128i keyed = _mm_xor_si128(data, key);
+			__m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+			__m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+			lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, swapped));
+		}
+	}
+	for (int i = 0; i < 4; i++)
+		_mm_storeu_si128(a + i, lanes[i]);
+}
+
+__attribute__((target("avx2")))
+static void xxh3AccumulateAvx2(uint64_t* acc, const unsigned char* input, 
+	const unsigned char* secret, size_t stripes) {
+	__m256i* a = (__m256i*)acc;
+	__m256i lanes[2] = { _mm256_loadu_si256(a), _mm256_loadu_si256(a + 1) };
+	for (size_t s = 0; s < stripes; s++) {
+		for (int i = 0; i < 2; i++) {
+			__m256i data = _mm256_loadu_si256((const __m256i*)(input + s * XXH3_STRIPE_LEN) + i);
+			__m256i key = _mm256_loadu_si256((const __m256i*)(secret + s * 8) + i);
+			__m256i keyed = _mm256_xor_si256(data, key);
+			__m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+			__m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+			lanes[i] = _mm256_add_epi64(lanes[i], _mm256_add_epi64(product, swapped));
+		}
+	}
+	_mm256_storeu_si256(a, lanes[0]);
+	_mm256_storeu_si256(a + 1, lanes[1]);
+}
+
+//gcc 12's avx512 headers start some intrinsics from an undefined vector,
+//	which it then warns about.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static void xxh3AccumulateAvx512(uint64_t* acc, const unsigned char* input, 
+	const unsigned char* secret, size_t stripes) {
+	__m512i lanes = _mm512_loadu_si512(acc);
+	for (size_t s = 0; s < stripes; s++) {
+		__m512i data = _mm512_loadu_si512(input + s * XXH3_STRIPE_LEN);
+		__m512i key = _mm512_loadu_si512(secret + s * 8);
+		__m512i keyed = _mm512_xor_si512(data, key);
+		__m512i product = _mm512_mul_epu32(keyed, _mm512_srli_epi64(keyed, 32));
+		__m512i swapped = _mm512_shuffle_epi32(data, (_MM_PERM_ENUM)_MM_SHUFFLE(1, 0, 3, 2));
+		lanes = _mm512_add_epi64(lanes, _mm512_add_epi64(product, swapped));
+	}
+	_mm512_storeu_si512(acc, lanes);
+}
+#pragma GCC diagnostic pop
+#endif
+
+xxh3AccumulateFn xxh3Kernel(const char** name) {
+	static xxh3AccumulateFn kernel = NULL;
+	static const char* kernelName = "scalar";
+	if (kernel == NULL) {
+		kernel = xxh3AccumulateScalar;
+#if defined(__x86_64__)
+		//SMASH_HASH_KERNEL=scalar|sse2|avx2 caps the choice, for comparing them.
+		const char* cap = getenv("SMASH_HASH_KERNEL");
+		string limit = cap != NULL ? cap : "avx512";
+		__builtin_cpu_init();
+		if (limit == "avx512" && __builtin_cpu_supports("avx512f")) {
+			kernel = xxh3AccumulateAvx512;
+			kernelName = "avx512";
+		}
+		else if ((limit == "avx512" || limit == "avx2") && __builtin_cpu_supports("avx2")) {
+			kernel = xxh3AccumulateAvx2;
+			kernelName = "avx2";
+		}
+		else if (limit != "scalar") {
+			kernel = xxh3AccumulateSse2;
+			kernelName = "sse2";
+		}
+#endif
+	}
+	if (name != NULL)
+		*name = kernelName;
+	return kernel;
+}
+
+static void xxh3Scramble(uint64_t* acc) {
+	const unsigned char* key = xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN;
+	for (int i = 0; i < 8; i++) {
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= readLE64(key + 8 * i);
+		acc[i] = a * XXH_PRIME32_1;
+	}
+}
+
+//Post:	'stripes' stripes of 'input' have been accumulated, scrambling every
+//			time a block of XXH3_BLOCK_STRIPES is complete.
+static void xxh3Consume(uint64_t* acc, size_t &stripesSoFar, const unsigned char* input, 
+	size_t stripes) {
+	xxh3AccumulateFn accumulate = xxh3Kernel();
+	while (stripes > 0) {
+		size_t run = XXH3_BLOCK_STRIPES - stripesSoFar;
+		if (run > stripes)
+			run = stripes;
+		accumulate(acc, input, xxh3Secret + stripesSoFar * 8, run);
+		input += run * XXH3_STRIPE_LEN;
+		stripes -= run;
+		stripesSoFar += run;
+		if (stripesSoFar == XXH3_BLOCK_STRIPES) {
+			xxh3Scramble(acc);
+			stripesSoFar = 0;
+		}
+	}
+}
+
+//Post:	The hash of inputs longer than 240 bytes is returned from the final
+//			accumulators, with 'last' the last XXH3_STRIPE_LEN bytes of input.
+static uint64_t xxh3Finish(uint64_t* acc, const unsigned char* last, uint64_t length) {
+	uint64_t lastAcc[8];
+	memcpy(lastAcc, acc, sizeof(lastAcc));
+	xxh3AccumulateScalar(lastAcc, last, xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - 7, 1);
+	uint64_t result = length * XXH_PRIME64_1;
+	for (int i = 0; i < 4; i++) {
+		result += mulFold64(lastAcc[2 * i] ^ readLE64(xxh3Secret + 11 + 16 * i), 
+			lastAcc[2 * i + 1] ^ readLE64(xxh3Secret + 11 + 16 * i + 8));
+	}
+	return xxh3Avalanche(result);
+}
+
+void xxh3Reset(xxh3State &state) {
+	const uint64_t init[8] = { XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3, 
+		XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1 };
+	memcpy(state.acc, init, sizeof(init));
+	state.bufferedSize = 0;
+	state.stripesSoFar = 0;
+	state.totalLength = 0;
+}
+
+void xxh3Update(xxh3State &state, const void* data, size_t length) {
+	const unsigned char* input = (const unsigned char*)data;
+	state.totalLength += length;
+	//the last bytes are always held back, the final stripe is hashed
+	//differently and can only be known once the input ends.
+	if (state.bufferedSize + length <= XXH3_BUFFER_SIZE) {
+		memcpy(state.buffer + state.bufferedSize, input, length);
+		state.bufferedSize += length;
+		return;
+	}
+	if (state.bufferedSize > 0) {
+		size_t fill = XXH3_BUFFER_SIZE - state.bufferedSize;
+		memcpy(state.buffer + state.bufferedSize, input, fill);
+		input += fill;
+		length -= fill;
+		xxh3Consume(state.acc, state.stripesSoFar, state.buffer, XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN);
+		memcpy(state.lastStripe, state.buffer + XXH3_BUFFER_SIZE - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+		state.bufferedSize = 0;
+	}
+	//everything but the last 1 to 64 bytes goes straight from the input.
+	if (length > XXH3_BUFFER_SIZE) {
+		size_t stripes = (length - 1) / XXH3_STRIPE_LEN;
+		xxh3Consume(state.acc, state.stripesSoFar, input, stripes);
+		input += stripes * XXH3_STRIPE_LEN;
+		length -= stripes * XXH3_STRIPE_LEN;
+		memcpy(state.lastStripe, input - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+	}
+	memcpy(state.buffer, input, length);
+	state.bufferedSize = length;
+}
+
+uint64_t xxh3Digest(const xxh3State &state) {
+	if (state.totalLength <= 16)
+		return xxh3Short(state.buffer, state.totalLength);
+	if (state.totalLength <= XXH3_MIDSIZE_MAX)
+		return xxh3Medium(state.buffer, state.totalLength);
+
+	uint64_t acc[8];
+	memcpy(acc, state.acc, sizeof(acc));
+	size_t stripesSoFar = state.stripesSoFar;
+	unsigned char last[XXH3_STRIPE_LEN];
+	if (state.bufferedSize >= XXH3_STRIPE_LEN) {
+		xxh3Consume(acc, stripesSoFar, state.buffer, (state.bufferedSize - 1) / XXH3_STRIPE_LEN);
+		memcpy(last, state.buffer + state.bufferedSize - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+	}
+	else {
+		//the final stripe starts in the data that was already consumed.
+		size_t catchup = XXH3_STRIPE_LEN - state.bufferedSize;
+		memcpy(last, state.lastStripe + XXH3_STRIPE_LEN - catchup, catchup);
+		memcpy(last + catchup, state.buffer, state.bufferedSize);
+	}
+	return xxh3Finish(acc, last, state.totalLength);
+}
+
+uint64_t xxh3Hash(const void* data, size_t length) {
+	const unsigned char* input = (const unsigned char*)data;
+	if (length <= 16)
+		return xxh3Short(input, length);
+	if (length <= XXH3_MIDSIZE_MAX)
+		return xxh3Medium(input, length);
+	xxh3State state;
+	xxh3Reset(state);
+	size_t stripesSoFar = 0;
+	size_t stripes = (length - 1) / XXH3_STRIPE_LEN;
+	xxh3Consume(state.acc, stripesSoFar, input, stripes);
+	return xxh3Finish(state.acc, input + length - XXH3_STRIPE_LEN, length);
+}
+
+const char* hexHash(uint64_t hash, scratchArena &scratch) {
+	char* digits = (char*)scratch.allocate(17, 1);
+	snprintf(digits, 17, "%016llx", (unsigned long long)hash);
+	return digits;
+}
+
+bool hashFile(int fd, uint64_t &hash) {
+	//the hash state is large, it and the buffer are kept per thread.
+	static thread_local xxh3State state;
+	//freed when the thread exits, parallel and copier threads come and go.
+	static thread_local unique_ptr<char[]> bufferMemory(new char[HASH_BUFFER_SIZE]);
+	char* buffer = bufferMemory.get();
+	xxh3Reset(state);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (off_t offset = 0; ; ) {
+		ssize_t n = pread(fd, buffer, HASH_BUFFER_SIZE, offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return false;
+		if (n == 0)
+			break;
+		xxh3Update(state, buffer, n);
+		offset += n;
+	}
+	hash = xxh3Digest(state);
+	return true;
+}
+
+bool verifiedCopy(int inFd, int outFd, uint64_t &hash, uint64_t &badHash) {
+	static thread_local xxh3State state;
+	static thread_local unique_ptr<char[]> bufferMemory(new char[HASH_BUFFER_SIZE]);
+	char* buffer = bufferMemory.get();
+	xxh3Reset(state);
+	posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	//the data has to pass through user space to be hashed, so this is one
+	//read and one write per buffer instead of the kernel side stages.
+	for (off_t offset = 0; ; ) {
+		ssize_t n = pread(inFd, buffer, HASH_BUFFER_SIZE, offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return false;
+		if (n == 0)
+			break;
+		xxh3Update(state, buffer, n);
+		if (!writeAllAt(outFd, buffer, n, offset))
+			return false;
+		offset += n;
+	}
+	hash = xxh3Digest(state);
+
+	//reading the destination back from the cache would only prove the copy
+	//in memory, so it is written out and dropped before the one read.
+	if (fdatasync(outFd) == -1)
+		return false;
+	posix_fadvise(outFd, 0, 0, POSIX_FADV_DONTNEED);
+	int readFd = open(("/proc/self/fd/" + to_string(outFd)).c_str(), O_RDONLY | O_CLOEXEC);
+	if (readFd == -1)
+		return false;
+	bool ok = hashFile(readFd, badHash);
+	close(readFd);
+	if (!ok)
+		return false;
+	if (badHash != hash) {
+		errno = EBADMSG;
+		return false;
+	}
+	return true;
+}
+
+// -- io_uring Engine --
+
+void uringInitEngine() {
+	const char* engine = getenv("SMASH_IO_ENGINE");
+	if (engine != NULL && strcmp(engine, "posix") == 0)
+		return;
+
+	uringQueue ring;
+	if (!uringSetup(ring, 4))
+		return;
+
+	//ask the kernel which operations it knows, older kernels have io_uring
+	//but not openat/statx/close.
+	size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	io_uring_probe* probe = (io_uring_probe*)calloc(1, probeSize);
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		const int ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, 
+			IORING_OP_WRITE, IORING_OP_CLOSE };
+		uringEnabled = true;
+		for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+			if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+				uringEnabled = false;
+		}
+	}
+	free(probe);
+	uringTeardown(ring);
+}
+
+bool uringAvailable() {
+	//a function static is initialised exactly once, even by racing threads.
+	static bool probed = (uringInitEngine(), true);
+	(void)probed;
+	return uringEnabled;
+}
+
+bool uringSetup(uringQueue &ring, unsigned entries) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring.fd < 0)
+		return false;
+
+	ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	//newer kernels map both rings with a single mmap.
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) {
+		if (ring.cqRingSize > ring.sqRingSize)
+			ring.sqRingSize = ring.cqRingSize;
+		ring.cqRingSize = ring.sqRingSize;
+	}
+
+	ring.sqRing = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.cqRing = single ? ring.sqRing : mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = (io_uring_sqe*)mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqRing == MAP_FAILED || ring.cqRing == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		if (ring.sqRing != MAP_FAILED)
+			munmap(ring.sqRing, ring.sqRingSize);
+		if (!single && ring.cqRing != MAP_FAILED)
+			munmap(ring.cqRing, ring.cqRingSize);
+		if (ring.sqes != MAP_FAILED)
+			munmap(ring.sqes, ring.sqesSize);
+		close(ring.fd);
+		return false;
+	}
+
+	char* sq = (char*)ring.sqRing;
+	char* cq = (char*)ring.cqRing;
+	ring.sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring.sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring.sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring.sqArray = (unsigned*)(sq + params.sq_off.array);
+	ring.cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring.cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring.cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring.cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+	ring.queued = 0;
+	ring.inFlight = 0;
+	return true;
+}
+
+void uringTeardown(uringQueue &ring) {
+	munmap(ring.sqes, ring.sqesSize);
+	if (ring.cqRing != ring.sqRing)
+		munmap(ring.cqRing, ring.cqRingSize);
+	munmap(ring.sqRing, ring.sqRingSize);
+	close(ring.fd);
+}
+
+io_uring_sqe* uringQueueOp(uringQueue &ring, int op, int fd, const void* addr, 
+	unsigned len, __u64 off, __u64 userData) {
+	unsigned tail = *ring.sqTail;
+	unsigned index = tail & *ring.sqMask;
+	io_uring_sqe* sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (__u64)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = userData;
+	ring.sqArray[index] = index;
+	//the kernel must see the filled entry before it sees the new tail.
+	__atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+	return sqe;
+}
+
+bool uringDrain(uringQueue &ring, int* results) {
+	traceScope span("io_uring_enter", ring.queued);
+	while (ring.queued > 0 || ring.inFlight > 0) {
+		int submitted = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 1, 
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		ring.queued -= submitted;
+		ring.inFlight += submitted;
+
+		//reap everything that has completed so far.
+		unsigned head = *ring.cqHead;
+		unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+			results[cqe->user_data] = cqe->res;
+			head++;
+			ring.inFlight--;
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+void uringCopyFiles(uringQueue &ring, int srcRootFd, int dstRootFd, 
+	const vector<copyTask> &tasks, treeCopyStats &stats) {
+	//each file owns 3 result slots and one buffer, results are negative errnos.
+	//the buffers live as long as the thread, they are reused by every batch.
+	static thread_local vector<char> buffers(URING_BATCH_FILES * URING_SMALL_FILE);
+	static thread_local vector<struct statx> stx(URING_BATCH_FILES);
+	size_t count = tasks.size();
+	int results[URING_BATCH_FILES * 3];
+	int inFds[URING_BATCH_FILES], outFds[URING_BATCH_FILES], lengths[URING_BATCH_FILES];
+
+	//round 1: open and statx every source.
+	for (size_t i = 0; i < count; i++) {
+		const char* path = tasks[i].path.c_str();
+		uringQueueOp(ring, IORING_OP_OPENAT, srcRootFd, path, 0, 0, i * 3)->open_flags = 
+			O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+		uringQueueOp(ring, IORING_OP_STATX, srcRootFd, path, STATX_MODE | STATX_SIZE, 
+			(__u64)(uintptr_t)&stx[i], i * 3 + 1)->statx_flags = AT_SYMLINK_NOFOLLOW;
+	}
+	fill(results, results + count * 3, -EIO);
+	if (!uringDrain(ring, results)) {
+		//the ring is unusable, copy this batch the POSIX way instead.
+		for (size_t i = 0; i < count; i++)
+			copyTreeFile(srcRootFd, dstRootFd, tasks[i].path.c_str(), stats);
+		return;
+	}
+
+	//round 2: read the small files and create their destinations.
+	for (size_t i = 0; i < count; i++) {
+		const char* path = tasks[i].path.c_str();
+		inFds[i] = results[i * 3];
+		outFds[i] = -1;
+		lengths[i] = -1;
+		if (inFds[i] < 0 || results[i * 3 + 1] < 0) {
+			stats.error(path, inFds[i] < 0 ? -inFds[i] : -results[i * 3 + 1]);
+			if (inFds[i] >= 0)
+				close(inFds[i]);
+			inFds[i] = -1;
+			continue;
+		}
+		if (stx[i].stx_size > URING_SMALL_FILE) {
+			//big files don't fit the buffers, the copy engine handles them.
+			close(inFds[i]);
+			inFds[i] = -1;
+			copyTreeFile(srcRootFd, dstRootFd, path, stats);
+			continue;
+		}
+		lengths[i] = stx[i].stx_size;
+		uringQueueOp(ring, IORING_OP_READ, inFds[i], &buffers[i * URING_SMALL_FILE], 
+			lengths[i], 0, i * 3);
+		uringQueueOp(ring, IORING_OP_OPENAT, dstRootFd, path, stx[i].stx_mode & 07777, 0, 
+			i * 3 + 1)->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	}
+	//a failed drain leaves -EIO behind, so those files are reported as failed.
+	fill(results, results + count * 3, -EIO);
+	uringDrain(ring, results);
+
+	//round 3: write the data out and close both files.
+	for (size_t i = 0; i < count; i++) {
+		if (inFds[i] < 0)
+			continue;
+		int length = results[i * 3];
+		outFds[i] = results[i * 3 + 1];
+		uringQueueOp(ring, IORING_OP_CLOSE, inFds[i], NULL, 0, 0, i * 3);
+		if (outFds[i] < 0 || length < 0) {
+			stats.error(tasks[i].path.c_str(), length < 0 ? -length : -outFds[i]);
+			lengths[i] = -1;
+			if (outFds[i] >= 0)
+				uringQueueOp(ring, IORING_OP_CLOSE, outFds[i], NULL, 0, 0, i * 3 + 2);
+			continue;
+		}
+		//a file that shrank since its statx is copied with its current data.
+		lengths[i] = length;
+		//the close is linked so it only runs after the write has finished.
+		uringQueueOp(ring, IORING_OP_WRITE, outFds[i], &buffers[i * URING_SMALL_FILE], 
+			length, 0, i * 3 + 1)->flags = IOSQE_IO_LINK;
+		uringQueueOp(ring, IORING_OP_CLOSE, outFds[i], NULL, 0, 0, i * 3 + 2);
+	}
+	fill(results, results + count * 3, -EIO);
+	uringDrain(ring, results);
+
+	for (size_t i = 0; i < count; i++) {
+		if (inFds[i] < 0 || lengths[i] < 0)
+			continue;
+		//a failed write cancels the linked close, so close it here instead.
+		if (results[i * 3 + 2] == -ECANCELED)
+			close(outFds[i]);
+		if (results[i * 3 + 1] != lengths[i])
+			stats.error(tasks[i].path.c_str(), results[i * 3 + 1] < 0 ? -results[i * 3 + 1] : EIO);
+		else if (results[i * 3 + 2] < 0 && results[i * 3 + 2] != -ECANCELED)
+			stats.error(tasks[i].path.c_str(), -results[i * 3 + 2]);
+		else
+			stats.copied(lengths[i]);
+	}
+}
+
+bool uringStatxBatch(uringQueue &ring, int dirFd, const char* const* names, size_t count,
+	unsigned flags, unsigned mask, struct statx* stx, int* results) {
+	for (size_t i = 0; i < count; i++) {
+		uringQueueOp(ring, IORING_OP_STATX, dirFd, names[i], mask, 
+			(__u64)(uintptr_t)&stx[i], i)->statx_flags = flags;
+	}
+	return uringDrain(ring, results);
+}
+
+
+
+// -- List Engine --
+
+void outputBuffer::append(const char* s, size_t n) {
+	if (used + n > OUTPUT_BUFFER_SIZE) {
+		flush();
+		//anything bigger than the whole buffer goes straight out.
+		if (n > OUTPUT_BUFFER_SIZE) {
+			emit(s, n);
+			return;
+		}
+	}
+	memcpy(data + used, s, n);
+	used += n;
+}
+
+void outputBuffer::flush() {
+	if (used > 0)
+		emit(data, used);
+	used = 0;
+}
+
+void outputBuffer::emit(const char* s, size_t n) {
+	if (target != NULL) {
+		target->insert(target->end(), s, s + n);
+	}
+	else if (fd == STDOUT_FILENO) {
+		//stdout goes through the sink, in order with what cout printed.
+		stdoutSink.write(s, n);
+	}
+	else if (lock != NULL) {
+		lock_guard<mutex> guard(*lock);
+		writeAll(fd, s, n);
+	}
+	else {
+		writeAll(fd, s, n);
+	}
+}
+
+bool writeAll(int fd, const char* s, size_t n) {
+	while (n > 0) {
+		ssize_t m = write(fd, s, n);
+		if (m == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		s += m;
+		n -= m;
+	}
+	return true;
+}
+
+bool writeAllAt(int fd, const char* s, size_t n, off_t offset) {
+	while (n > 0) {
+		ssize_t m = pwrite(fd, s, n, offset);
+		if (m == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		s += m;
+		n -= m;
+		offset += m;
+	}
+	return true;
+}
+
+outputFormat parseFormat(const char* arg) {
+	if (strcmp(arg, "--json") == 0)
+		return FORMAT_JSON;
+	if (strcmp(arg, "-0") == 0)
+		return FORMAT_NUL;
+	return FORMAT_TEXT;
+}
+
+//Post:	The length of the UTF-8 sequence at the start of the 'n' bytes of 's'
+//			is returned, 0 if they don't start with a valid one.
+static size_t utf8Length(const unsigned char* s, size_t n) {
+	size_t length;
+	unsigned char low = 0x80, high = 0xbf;
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		length = 2;
+	}
+	else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		length = 3;
+		//no overlong forms and no UTF-16 surrogates.
+		if (s[0] == 0xe0)
+			low = 0xa0;
+		else if (s[0] == 0xed)
+			high = 0x9f;
+	}
+	else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		length = 4;
+		//no overlong forms and nothing above U+10FFFF.
+		if (s[0] == 0xf0)
+			low = 0x90;
+		else if (s[0] == 0xf4)
+			high = 0x8f;
+	}
+	else {
+		return 0;
+	}
+	if (n < length || s[1] < low || s[1] > high)
+		return 0;
+	for (size_t i = 2; i < length; i++) {
+		if (s[i] < 0x80 || s[i] > 0xbf)
+			return 0;
+	}
+	return length;
+}
+
+void appendJsonChars(outputBuffer &out, const char* s, size_t n) {
+	const unsigned char* bytes = (const unsigned char*)s;
+	//the characters that need nothing are appended in runs between the
+	//	ones that have to be escaped.
+	size_t run = 0;
+	for (size_t i = 0; i < n; ) {
+		unsigned char c = bytes[i];
+		if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80) {
+			i++;
+			continue;
+		}
+		if (c >= 0x80) {
+			size_t length = utf8Length(bytes + i, n - i);
+			if (length > 0) {
+				i += length;
+				continue;
+			}
+		}
+		out.append(s + run, i - run);
+		char escape[8];
+		int length = 2;
+		escape[0] = '\\';
+		if (c == '"' || c == '\\')
+			escape[1] = c;
+		else if (c == '\n')
+			escape[1] = 'n';
+		else if (c == '\t')
+			escape[1] = 't';
+		else if (c == '\r')
+			escape[1] = 'r';
+		else
+			length = snprintf(escape, sizeof(escape), "\\u%04x", c);
+		out.append(escape, length);
+		run = ++i;
+	}
+	out.append(s + run, n - run);
+}
+
+void appendNumber(outputBuffer &out, int64_t value) {
+	//the digits are written from the back of the buffer.
+	char digits[24];
+	char* p = digits + sizeof(digits);
+	uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+	do {
+		*--p = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (value < 0)
+		*--p = '-';
+	out.append(p, digits + sizeof(digits) - p);
+}
+
+const char* typeName(unsigned char type) {
+	switch (type) {
+	case DT_REG: return "file";
+	case DT_DIR: return "dir";
+	case DT_LNK: return "link";
+	case DT_FIFO: return "fifo";
+	case DT_SOCK: return "socket";
+	case DT_CHR: return "char";
+	case DT_BLK: return "block";
+	default: return "unknown";
+	}
+}
+
+//Post:	'perms' holds the type letter of 'mode' followed by its rwx bits, as
+//			in ls -l.
+static void formatMode(mode_t mode, char perms[11]) {
+	perms[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' :
+		S_ISBLK(mode) ? 'b' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : '-';
+	const char* rwx = "rwxrwxrwx";
+	for (int bit = 0; bit < 9; bit++)
+		perms[bit + 1] = (mode & (0400 >> bit)) ? rwx[bit] : '-';
+	perms[10] = '\0';
+}
+
+//Post:	The entry 'name' after 'prefix' has been appended to 'out' as a JSON
+//			object on one line. 'stx' holds its metadata for a long listing,
+//			or is NULL with 'error' the negative errno of a failed statx (0
+//			when only the name and its DT_ 'type' are wanted).
+static void appendEntryJson(outputBuffer &out, string_view prefix, const char* name, size_t length, 
+	unsigned char type, const struct statx* stx, int error) {
+	//the worst case is reserved, so the buffers of the walker threads never
+	//	split an object when they are flushed.
+	out.reserve((prefix.size() + length) * 6 + 160);
+	out.append("{\"name\":\"", 9);
+	appendJsonChars(out, prefix.data(), prefix.size());
+	appendJsonChars(out, name, length);
+	out.append("\",\"type\":\"", 10);
+	const char* kind = typeName(stx != NULL ? IFTODT(stx->stx_mode) : type);
+	out.append(kind, strlen(kind));
+	out.append("\"", 1);
+	if (stx != NULL) {
+		char perms[11];
+		formatMode(stx->stx_mode, perms);
+		out.append(",\"mode\":\"", 9);
+		out.append(perms, 10);
+		out.append("\",\"size\":", 9);
+		appendNumber(out, stx->stx_size);
+		out.append(",\"mtime\":", 9);
+		appendNumber(out, stx->stx_mtime.tv_sec);
+	}
+	else if (error < 0) {
+		const char* message = strerror(-error);
+		out.append(",\"error\":\"", 10);
+		appendJsonChars(out, message, strlen(message));
+		out.append("\"", 1);
+	}
+	out.append("}\n", 2);
+}
+
+char* direntBuffer() {
+	//the buffer is kept between listings, huge directories would otherwise
+	//pay for a fresh 1 MB allocation on every call.
+	//it's freed when the thread exits, every list -R makes new walkers.
+	static thread_local unique_ptr<char[]> entries(new char[DIRENT_BUFFER_SIZE]);
+	return entries.get();
+}
+
+bool listNames(int dirFd, outputFormat format, outputBuffer &out) {
+	char* entries = direntBuffer();
+	char end = format == FORMAT_NUL ? '\0' : '\n';
+	while (true) {
+		//a span covers a batch of entries and printing it.
+		traceScope span("getdents64");
+		long n = syscall(SYS_getdents64, dirFd, entries, DIRENT_BUFFER_SIZE);
+		span.arg = n;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (n == 0)
+			return true;
+		for (long pos = 0; pos < n; ) {
+			linuxDirent64* ep = (linuxDirent64*)(entries + pos);
+			size_t nameLength = strlen(ep->d_name);
+			pos += ep->d_reclen;
+			if (format == FORMAT_JSON) {
+				appendEntryJson(out, string_view(), ep->d_name, nameLength, ep->d_type, NULL, 0);
+				continue;
+			}
+			//the name is followed by its newline in a single copy when possible.
+			ep->d_name[nameLength] = end;
+			out.append(ep->d_name, nameLength + 1);
+		}
+	}
+}
+
+bool cachedList(int dirFd, const listOptions &opts, outputBuffer &out) {
+	lock_guard<mutex> guard(listings.lock);
+	if (!listings.started) {
+		listings.started = true;
+		listings.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	}
+	drainListCache();
+	struct stat dirStat;
+	if (fstat(dirFd, &dirStat) == -1)
+		return false;
+
+	size_t index = 0;
+	for (; index < listings.entries.size(); index++) {
+		cachedListing &entry = listings.entries[index];
+		if (entry.dev == dirStat.st_dev && entry.ino == dirStat.st_ino)
+			break;
+	}
+	//without a watch the directory only counts as unchanged while its
+	//mtime is what it was when the names were read.
+	if (index < listings.entries.size()) {
+		cachedListing &entry = listings.entries[index];
+		if (entry.watch == -1 && (entry.mtime.tv_sec != dirStat.st_mtim.tv_sec || 
+			entry.mtime.tv_nsec != dirStat.st_mtim.tv_nsec)) {
+			dropListing(index);
+			index = listings.entries.size();
+		}
+	}
+
+	cachedListing fresh;
+	bool cacheable = true;
+	if (index == listings.entries.size()) {
+		fresh.dev = dirStat.st_dev;
+		fresh.ino = dirStat.st_ino;
+		fresh.mtime = dirStat.st_mtim;
+		fresh.hasSorted = false;
+		fresh.hasOutput[0] = fresh.hasOutput[1] = false;
+		fresh.watch = -1;
+		if (listings.inotifyFd != -1) {
+			string path = "/proc/self/fd/" + to_string(dirFd);
+			fresh.watch = inotify_add_watch(listings.inotifyFd, path.c_str(), 
+				IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR);
+		}
+		//an mtime can't tell apart changes within its granularity, so a
+		//directory that changed just now is listed without being kept.
+		if (fresh.watch == -1) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			cacheable = now.tv_sec - dirStat.st_mtim.tv_sec >= LIST_CACHE_SETTLE_SECONDS;
+		}
+		long n;
+		while ((n = readNames(dirFd, fresh.names)) > 0)
+			;
+		if (n == -1) {
+			if (fresh.watch != -1)
+				inotify_rm_watch(listings.inotifyFd, fresh.watch);
+			return false;
+		}
+		if (cacheable && listings.entries.size() == LIST_CACHE_SIZE) {
+			size_t oldest = 0;
+			for (size_t i = 1; i < listings.entries.size(); i++) {
+				if (listings.entries[i].lastUse < listings.entries[oldest].lastUse)
+					oldest = i;
+			}
+			dropListing(oldest);
+		}
+		if (cacheable) {
+			listings.entries.push_back(move(fresh));
+			index = listings.entries.size() - 1;
+		}
+		else if (fresh.watch != -1) {
+			inotify_rm_watch(listings.inotifyFd, fresh.watch);
+		}
+	}
+	cachedListing &entry = cacheable ? listings.entries[index] : fresh;
+	entry.lastUse = ++listings.clock;
+
+	if (opts.sorted && !entry.hasSorted) {
+		entry.sorted = entry.names;
+		sortNames(entry.sorted);
+		entry.hasSorted = true;
+	}
+	const nameArena &names = opts.sorted ? entry.sorted : entry.names;
+	//the sizes and times of a long listing can change without the names
+	//changing, so only the names come from the cache. only the text of a
+	//plain listing is kept.
+	if (opts.longFormat || opts.format != FORMAT_TEXT) {
+		printNames(dirFd, names, opts.longFormat, opts.format, out);
+		return true;
+	}
+	int order = opts.sorted ? 1 : 0;
+	if (!entry.hasOutput[order]) {
+		outputBuffer collect(-1);
+		collect.target = &entry.output[order];
+		printNames(dirFd, names, false, FORMAT_TEXT, collect);
+		collect.flush();
+		entry.hasOutput[order] = true;
+	}
+	out.append(entry.output[order].data(), entry.output[order].size());
+	return true;
+}
+
+void drainListCache() {
+	if (listings.inotifyFd == -1)
+		return;
+	alignas(struct inotify_event) char events[4096];
+	ssize_t n;
+	while ((n = read(listings.inotifyFd, events, sizeof(events))) > 0) {
+		for (ssize_t pos = 0; pos < n; ) {
+			struct inotify_event* event = (struct inotify_event*)(events + pos);
+			pos += sizeof(struct inotify_event) + event->len;
+			//events were lost, so nothing cached can be trusted.
+			if (event->mask & IN_Q_OVERFLOW) {
+				while (!listings.entries.empty())
+					dropListing(listings.entries.size() - 1);
+				continue;
+			}
+			for (size_t i = 0; i < listings.entries.size(); i++) {
+				if (listings.entries[i].watch == event->wd) {
+					//the kernel already removed the watch of a deleted directory.
+					if (event->mask & IN_IGNORED)
+						listings.entries[i].watch = -1;
+					dropListing(i);
+					break;
+				}
+			}
+		}
+	}
+}
+
+void dropListing(size_t index) {
+	cachedListing &entry = listings.entries[index];
+	if (entry.watch != -1)
+		inotify_rm_watch(listings.inotifyFd, entry.watch);
+	if (index + 1 != listings.entries.size())
+		entry = move(listings.entries.back());
+	listings.entries.pop_back();
+}
+
+void nameArena::add(const char* name, size_t length, unsigned char type) {
+	bytes.push_back(type);
+	offsets.push_back(bytes.size());
+	bytes.insert(bytes.end(), name, name + length + 1);
+}
+
+long readNames(int dirFd, nameArena &arena) {
+	traceScope span("getdents64");
+	char* entries = direntBuffer();
+	long n;
+	do {
+		n = syscall(SYS_getdents64, dirFd, entries, DIRENT_BUFFER_SIZE);
+	} while (n == -1 && errno == EINTR);
+	span.arg = n;
+
+	for (long pos = 0; pos < n; ) {
+		linuxDirent64* ep = (linuxDirent64*)(entries + pos);
+		size_t nameLength = strlen(ep->d_name);
+		arena.add(ep->d_name, nameLength, ep->d_type);
+		pos += ep->d_reclen;
+	}
+	return n;
+}
+
+void sortNames(nameArena &arena) {
+	const char* base = arena.bytes.data();
+	sort(arena.offsets.begin(), arena.offsets.end(), [base](uint32_t x, uint32_t y) {
+		return strcmp(base + x, base + y) < 0;
+	});
+}
+
+void printNames(int dirFd, const nameArena &arena, bool longFormat, outputFormat format, 
+	outputBuffer &out, const string &prefix) {
+	char end = format == FORMAT_NUL ? '\0' : '\n';
+	if (!longFormat) {
+		for (size_t i = 0; i < arena.size(); i++) {
+			const char* name = arena.name(i);
+			size_t nameLength = strlen(name);
+			if (format == FORMAT_JSON) {
+				appendEntryJson(out, prefix, name, nameLength, arena.type(i), NULL, 0);
+				continue;
+			}
+			out.reserve(prefix.size() + nameLength + 1);
+			out.append(prefix.data(), prefix.size());
+			out.append(name, nameLength);
+			out.append(&end, 1);
+		}
+		return;
+	}
+
+	const char* names[STATX_BATCH_SIZE];
+	struct statx stx[STATX_BATCH_SIZE];
+	int results[STATX_BATCH_SIZE];
+	for (size_t start = 0; start < arena.size(); start += STATX_BATCH_SIZE) {
+		size_t count = min((size_t)STATX_BATCH_SIZE, arena.size() - start);
+		for (size_t i = 0; i < count; i++)
+			names[i] = arena.name(start + i);
+		statxNames(dirFd, names, count, stx, results);
+
+		for (size_t i = 0; i < count; i++) {
+			size_t nameLength = strlen(names[i]);
+			if (format == FORMAT_JSON) {
+				appendEntryJson(out, prefix, names[i], nameLength, arena.type(start + i), 
+					results[i] < 0 ? NULL : &stx[i], results[i]);
+				continue;
+			}
+			char line[128];
+			int n;
+			if (results[i] < 0) {
+				n = format == FORMAT_NUL ? snprintf(line, sizeof(line), "?\t?\t?\t") :
+					snprintf(line, sizeof(line), "%-10s %12s %16s  ", "?", "?", "?");
+			}
+			else {
+				char perms[11];
+				formatMode(stx[i].stx_mode, perms);
+				//programs get the mtime in seconds since the epoch.
+				if (format == FORMAT_NUL) {
+					n = snprintf(line, sizeof(line), "%s\t%llu\t%lld\t", perms, 
+						(unsigned long long)stx[i].stx_size, (long long)stx[i].stx_mtime.tv_sec);
+				}
+				else {
+					char when[32];
+					time_t mtime = stx[i].stx_mtime.tv_sec;
+					struct tm local;
+					localtime_r(&mtime, &local);
+					strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &local);
+					n = snprintf(line, sizeof(line), "%s %12llu %16s  ", perms, 
+						(unsigned long long)stx[i].stx_size, when);
+				}
+			}
+			out.reserve(n + prefix.size() + nameLength + 1);
+			out.append(line, n);
+			out.append(prefix.data(), prefix.size());
+			out.append(names[i], nameLength);
+			out.append(&end, 1);
+		}
+	}
+}
+
+void statxNames(int dirFd, const char* const* names, size_t count, struct statx* stx, int* results) {
+	traceScope span("statx", count);
+	const unsigned flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+	const unsigned mask = STATX_MODE | STATX_SIZE | STATX_MTIME;
+
+	//each thread sets up its ring the first time it lists with metadata.
+	static thread_local threadRing ring;
+	if (ring.state == 0 && uringAvailable())
+		ring.state = uringSetup(ring.queue, URING_ENTRIES) ? 1 : -1;
+	if (ring.state == 1) {
+		if (uringStatxBatch(ring.queue, dirFd, names, count, flags, mask, stx, results))
+			return;
+		uringTeardown(ring.queue);
+		ring.state = -1;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		results[i] = statx(dirFd, names[i], flags, mask, &stx[i]) == 0 ? 0 : -errno;
+}
+
+//Post:	'path' followed by the 'length' bytes of 'name', and a '/' when 'dir',
+//			has been added to 'matches'.
+static void addMatch(nameArena &matches, const string &path, const char* name, size_t length, 
+	bool dir) {
+	static thread_local string match;
+	match.assign(path).append(name, length);
+	if (dir)
+		match += '/';
+	matches.add(match.data(), match.size(), DT_UNKNOWN);
+}
+
+void treeList(int rootFd, const listOptions &opts) {
+	treeWalk walk;
+	walk.rootFd = rootFd;
+	walk.opts = opts;
+	walk.pending = 1;
+	walk.errors = 0;
+	walk.glob = NULL;
+	walk.matches = NULL;
+	runTreeWalk(walk, opts.jobs, !opts.unordered);
+	if (walk.errors > 0)
+		cout << walk.errors << " directories could not be read.\n";
+}
+
+void runTreeWalk(treeWalk &walk, int jobs, bool ordered) {
+	if (jobs == 0) {
+		jobs = thread::hardware_concurrency();
+		if (jobs < 1)
+			jobs = 1;
+	}
+
+	//every queued directory holds a descriptor, so allow as many as we may.
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	for (int t = 0; t < jobs; t++)
+		walk.deques.push_back(new walkDeque);
+	walkItem root;
+	root.fd = dup(walk.rootFd);
+	root.node = ordered ? new walkNode : NULL;
+	walk.deques[0]->items.push_back(root);
+
+	vector<thread> workers;
+	for (int t = 0; t < jobs; t++)
+		workers.push_back(thread(walkWorker, ref(walk), t));
+
+	//a deterministic walk is printed by this thread, depth first, each
+	//directory as soon as it and everything before it has been listed.
+	if (root.node != NULL) {
+		vector<walkNode*> stack(1, root.node);
+		while (!stack.empty()) {
+			walkNode* node = stack.back();
+			stack.pop_back();
+			unique_lock<mutex> guard(walk.nodeLock);
+			while (!node->done)
+				walk.nodeDone.wait(guard);
+			guard.unlock();
+
+			stdoutSink.write(node->output.data(), node->output.size());
+			for (size_t i = node->children.size(); i > 0; i--)
+				stack.push_back(node->children[i - 1]);
+			delete node;
+		}
+	}
+
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+		delete walk.deques[t];
+	}
+}
+
+void walkWorker(treeWalk &walk, size_t self) {
+	//an unordered walk formats into this buffer until it fills up, and only
+	//then takes the output lock for a single write.
+	outputBuffer out(STDOUT_FILENO);
+	out.lock = &walk.outLock;
+	size_t threads = walk.deques.size();
+	int idle = 0;
+	while (walk.pending > 0) {
+		walkItem item;
+		bool found = false;
+		{
+			walkDeque &mine = *walk.deques[self];
+			lock_guard<mutex> guard(mine.lock);
+			if (!mine.items.empty()) {
+				item = mine.items.back();
+				mine.items.pop_back();
+				found = true;
+			}
+		}
+		//our deque is empty, try to steal the oldest item of another thread.
+		for (size_t i = 1; !found && i < threads; i++) {
+			walkDeque &victim = *walk.deques[(self + i) % threads];
+			lock_guard<mutex> guard(victim.lock);
+			if (!victim.items.empty()) {
+				item = victim.items.front();
+				victim.items.pop_front();
+				found = true;
+			}
+		}
+
+		if (!found) {
+			//nothing to steal yet, another thread is still inside a directory.
+			if (++idle < WALK_STEAL_SPINS) {
+				this_thread::yield();
+			}
+			else {
+				//the walk may be nearly done, don't leave output sitting here.
+				out.flush();
+				this_thread::sleep_for(chrono::microseconds(100));
+			}
+			continue;
+		}
+		idle = 0;
+		walkDirectory(walk, self, item, out);
+		walk.pending--;
+	}
+	out.flush();
+}
+
+void walkDirectory(treeWalk &walk, size_t self, walkItem &item, outputBuffer &out) {
+	static thread_local nameArena arena, shown;
+	arena.clear();
+	shown.clear();
+
+	int fd = item.fd;
+	if (fd == -1) {
+		const char* path = item.path.empty() ? "." : item.path.c_str();
+		fd = openat(walk.rootFd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	long n = -1;
+	if (fd != -1) {
+		while ((n = readNames(fd, arena)) > 0)
+			;
+	}
+	if (n != 0)
+		walk.errors++;
+
+	//a deterministic walk sorts every directory and collects its listing in
+	//its node, so the printing thread can write it out in tree order.
+	if (item.node != NULL) {
+		sortNames(arena);
+		out.flush();
+		out.target = &item.node->output;
+	}
+
+	//a glob walk matches the path of each entry below its root, the
+	//	components of the directory's path are split once for all of them.
+	static thread_local vector<string_view> parts;
+	static thread_local nameArena found;
+	static thread_local string dirPath;
+	if (walk.glob != NULL) {
+		parts.clear();
+		found.clear();
+		for (size_t p = 0; p < item.path.size(); ) {
+			size_t slash = item.path.find('/', p);
+			parts.push_back(string_view(item.path).substr(p, slash - p));
+			p = slash + 1;
+		}
+		parts.push_back(string_view());
+		dirPath.assign(walk.globPrefix).append(item.path);
+	}
+
+	//"." and ".." aren't printed, they would repeat in every directory.
+	vector<walkNode*> children;
+	for (size_t i = 0; i < arena.size(); i++) {
+		const char* name = arena.name(i);
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		unsigned char type = arena.type(i);
+		size_t nameLength = strlen(name);
+		if (walk.glob == NULL)
+			shown.add(name, nameLength, type);
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+				type = DT_DIR;
+		}
+		if (walk.glob != NULL) {
+			const globPattern &p = *walk.glob;
+			parts.back() = string_view(name, nameLength);
+			if ((!p.dirsOnly || type == DT_DIR) && 
+				matchPath(p, walk.globFirst, parts.data(), parts.size()))
+				addMatch(found, dirPath, name, nameLength, p.dirsOnly);
+			//like in other shells "**" doesn't go into hidden directories.
+			if (name[0] == '.')
+				continue;
+		}
+		if (type != DT_DIR)
+			continue;
+
+		walkItem child;
+		child.path = item.path + name + "/";
+		child.fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (child.fd == -1 && errno != EMFILE && errno != ENFILE) {
+			walk.errors++;
+			continue;
+		}
+		child.node = NULL;
+		if (item.node != NULL) {
+			child.node = new walkNode;
+			children.push_back(child.node);
+		}
+		walk.pending++;
+		walkDeque &mine = *walk.deques[self];
+		lock_guard<mutex> guard(mine.lock);
+		mine.items.push_back(child);
+	}
+	if (fd != -1 && walk.glob == NULL)
+		printNames(fd, shown, walk.opts.longFormat, walk.opts.format, out, item.path);
+	if (walk.glob != NULL && found.size() > 0) {
+		lock_guard<mutex> guard(walk.outLock);
+		for (size_t i = 0; i < found.size(); i++) {
+			const char* match = found.name(i);
+			walk.matches->add(match, strlen(match), found.type(i));
+		}
+	}
+
+	if (fd != -1)
+		close(fd);
+	if (item.node != NULL) {
+		out.flush();
+		out.target = NULL;
+		lock_guard<mutex> guard(walk.nodeLock);
+		item.node->children.swap(children);
+		item.node->done = true;
+		walk.nodeDone.notify_all();
+	}
+}
+
+
+
+// -- Glob Expansion --
+
+//Post:	'c' holds the steps of the component from 's' to 'end'.
+static void compileComponent(const char* s, const char* end, globComponent &c) {
+	c.recursive = end - s == 2 && s[0] == '*' && s[1] == '*';
+	c.isLiteral = true;
+	for (const char* p = s; p < end; p++) {
+		globStep step;
+		if (*p == '*') {
+			c.isLiteral = false;
+			if (c.steps.empty() || c.steps.back().op != GLOB_STAR) {
+				step.op = GLOB_STAR;
+				c.steps.push_back(step);
+			}
+			continue;
+		}
+		if (*p == '?') {
+			c.isLiteral = false;
+			step.op = GLOB_ANY;
+			c.steps.push_back(step);
+			continue;
+		}
+		if (*p == '[') {
+			//a ']' right after the '[' (or the '!') is one of the characters.
+			const char* q = p + 1;
+			bool negate = q < end && (*q == '!' || *q == '^');
+			if (negate)
+				q++;
+			const char* first = q;
+			if (q < end && *q == ']')
+				q++;
+			while (q < end && *q != ']') {
+				if (*q == '\\' && q + 1 < end)
+					q++;
+				q++;
+			}
+			//without a closing ']' the '[' is an ordinary character.
+			if (q < end) {
+				globSet set;
+				memset(set.bits, 0, sizeof(set.bits));
+				for (const char* r = first; r < q; r++) {
+					if (*r == '\\' && r + 1 < q)
+						r++;
+					unsigned char low = *r, high = *r;
+					if (r + 2 < q && r[1] == '-') {
+						r += 2;
+						if (*r == '\\' && r + 1 < q)
+							r++;
+						high = *r;
+					}
+					for (unsigned int ch = low; ch <= high; ch++)
+						set.bits[ch >> 6] |= (uint64_t)1 << (ch & 63);
+				}
+				if (negate) {
+					for (int b = 0; b < 4; b++)
+						set.bits[b] = ~set.bits[b];
+				}
+				c.isLiteral = false;
+				step.op = GLOB_SET;
+				step.arg = c.sets.size();
+				c.sets.push_back(set);
+				c.steps.push_back(step);
+				p = q;
+				continue;
+			}
+		}
+		if (*p == '\\' && p + 1 < end)
+			p++;
+		step.op = GLOB_CHAR;
+		step.arg = (unsigned char)*p;
+		c.steps.push_back(step);
+		c.literal += *p;
+	}
+
+	//the characters after the last '*' have to end every match.
+	size_t tail = c.steps.size();
+	while (tail > 0 && c.steps[tail - 1].op == GLOB_CHAR)
+		tail--;
+	if (tail > 0 && c.steps[tail - 1].op == GLOB_STAR) {
+		for (size_t i = tail; i < c.steps.size(); i++)
+			c.suffix += (char)c.steps[i].arg;
+	}
+}
+
+bool compileGlob(const char* pattern, globPattern &p) {
+	p.base.clear();
+	p.parts.clear();
+	p.dirsOnly = false;
+	const char* s = pattern;
+	if (*s == '/')
+		p.base = "/";
+	while (*s == '/')
+		s++;
+	bool wildcards = false;
+	while (*s != '\0') {
+		const char* end = s;
+		while (*end != '\0' && *end != '/') {
+			if (*end == '\\' && end[1] != '\0' && end[1] != '/')
+				end++;
+			end++;
+		}
+		globComponent c;
+		compileComponent(s, end, c);
+		s = end;
+		while (*s == '/')
+			s++;
+		if (*end == '/' && *s == '\0')
+			p.dirsOnly = true;
+
+		//the literal components in front make up the directory the
+		//	expansion starts in, which is opened with a single open.
+		if (c.isLiteral && p.parts.empty() && *s != '\0') {
+			p.base.append(c.literal).append("/");
+			continue;
+		}
+		wildcards = wildcards || !c.isLiteral;
+		p.parts.push_back(c);
+	}
+	return wildcards;
+}
+
+bool matchComponent(const globComponent &c, const char* name, size_t length) {
+	if (c.isLiteral)
+		return length == c.literal.size() && memcmp(name, c.literal.data(), length) == 0;
+	//hidden names need a literal '.', and "." and ".." are never matched.
+	if (name[0] == '.' && (c.steps[0].op != GLOB_CHAR || c.steps[0].arg != '.' || 
+		length == 1 || (length == 2 && name[1] == '.')))
+		return false;
+	if (length < c.suffix.size() || 
+		memcmp(name + length - c.suffix.size(), c.suffix.data(), c.suffix.size()) != 0)
+		return false;
+
+	//a '*' matches nothing at first. when the steps after it fail it takes
+	//	one more character and they are tried again, only the last '*'
+	//	ever has to be backed up to.
+	const vector<globStep> &steps = c.steps;
+	size_t step = 0, i = 0;
+	size_t starStep = steps.size(), starName = 0;
+	while (i < length) {
+		if (step < steps.size()) {
+			const globStep &s = steps[step];
+			if (s.op == GLOB_STAR) {
+				starStep = step++;
+				starName = i;
+				continue;
+			}
+			unsigned char ch = name[i];
+			if (s.op == GLOB_ANY || (s.op == GLOB_CHAR && ch == s.arg) || 
+				(s.op == GLOB_SET && c.sets[s.arg].has(ch))) {
+				step++;
+				i++;
+				continue;
+			}
+		}
+		if (starStep == steps.size())
+			return false;
+		step = starStep + 1;
+		i = ++starName;
+	}
+	while (step < steps.size() && steps[step].op == GLOB_STAR)
+		step++;
+	return step == steps.size();
+}
+
+bool matchPath(const globPattern &p, size_t first, const string_view* names, size_t count) {
+	for (size_t part = first; part < p.parts.size(); part++) {
+		const globComponent &c = p.parts[part];
+		if (c.recursive) {
+			//"**" takes as many directories as the rest needs.
+			for (size_t skip = 0; skip <= count; skip++) {
+				if (matchPath(p, part + 1, names + skip, count - skip))
+					return true;
+			}
+			return false;
+		}
+		if (count == 0 || !matchComponent(c, names[0].data(), names[0].size()))
+			return false;
+		names++;
+		count--;
+	}
+	return count == 0;
+}
+
+size_t expandGlob(const char* pattern, nameArena &matches) {
+	globPattern p;
+	if (!compileGlob(pattern, p))
+		return 0;
+	int dirFd = open(p.base.empty() ? "." : p.base.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirFd == -1)
+		return 0;
+	size_t before = matches.size();
+	string path = p.base;
+	expandFrom(p, 0, dirFd, path, matches);
+	close(dirFd);
+	sortNames(matches);
+	return matches.size() - before;
+}
+
+void expandFrom(const globPattern &p, size_t part, int dirFd, string &path, nameArena &matches) {
+	const globComponent &c = p.parts[part];
+	bool last = part + 1 == p.parts.size();
+	if (c.recursive) {
+		globTree(p, part, dirFd, path, matches);
+		return;
+	}
+
+	//a literal name is only looked up, its directory isn't read.
+	size_t pathLength = path.size();
+	if (c.isLiteral) {
+		if (last) {
+			struct stat st;
+			if (fstatat(dirFd, c.literal.c_str(), &st, p.dirsOnly ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+				(!p.dirsOnly || S_ISDIR(st.st_mode)))
+				addMatch(matches, path, c.literal.data(), c.literal.size(), p.dirsOnly);
+			return;
+		}
+		int fd = openat(dirFd, c.literal.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1)
+			return;
+		path.append(c.literal).append("/");
+		expandFrom(p, part + 1, fd, path, matches);
+		path.resize(pathLength);
+		close(fd);
+		return;
+	}
+
+	nameArena names;
+	while (readNames(dirFd, names) > 0)
+		;
+	for (size_t i = 0; i < names.size(); i++) {
+		const char* name = names.name(i);
+		size_t nameLength = strlen(name);
+		if (!matchComponent(c, name, nameLength))
+			continue;
+		//only directories lead further, links and filesystems without
+		//	d_type need a stat to tell.
+		unsigned char type = names.type(i);
+		if ((!last || p.dirsOnly) && type != DT_DIR) {
+			struct stat st;
+			if ((type != DT_LNK && type != DT_UNKNOWN) || fstatat(dirFd, name, &st, 0) != 0 || 
+				!S_ISDIR(st.st_mode))
+				continue;
+		}
+		if (last) {
+			addMatch(matches, path, name, nameLength, p.dirsOnly);
+			continue;
+		}
+		int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		path.append(name, nameLength).append("/");
+		expandFrom(p, part + 1, fd, path, matches);
+		path.resize(pathLength);
+		close(fd);
+	}
+}
+
+void globTree(const globPattern &p, size_t part, int dirFd, const string &path, nameArena &matches) {
+	treeWalk walk;
+	walk.rootFd = dirFd;
+	walk.opts.longFormat = false;
+	walk.opts.sorted = false;
+	walk.opts.recursive = true;
+	walk.opts.unordered = true;
+	walk.opts.jobs = 0;
+	walk.opts.format = FORMAT_TEXT;
+	walk.pending = 1;
+	walk.errors = 0;
+	walk.glob = &p;
+	walk.globFirst = part;
+	walk.globPrefix = path;
+	walk.matches = &matches;
+	runTreeWalk(walk, 0, false);
+}
+
+// -- Process Launch --
+
+//what a clone(CLONE_VM | CLONE_VFORK) child needs, it shares our memory so
+//	it can report an exec failure by writing into 'error'.
+struct vforkArgs {
+	const char* path;
+	char* const* argv;
+	const int* redirect;
+	int error;
+};
+
+//Post:	The calling child has every signal unblocked and the descriptors of
+//			'redirect' as stdin and stdout.
+static void prepareChild(const int* redirect) {
+	sigset_t none;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	for (int i = 0; redirect != NULL && i < 2; i++) {
+		if (redirect[i] >= 0 && redirect[i] != i)
+			dup2(redirect[i], i);
+	}
+}
+
+//the start routine of a vfork style child.
+static int vforkChild(void* arg) {
+	vforkArgs* args = (vforkArgs*)arg;
+	prepareChild(args->redirect);
+	execve(args->path, args->argv, environ);
+	args->error = errno;
+	_exit(127);
+}
+
+//the posix_spawn attributes every child is started with.
+static posix_spawnattr_t* defaultSpawnAttr() {
+	static posix_spawnattr_t attr;
+	sigset_t none;
+	sigemptyset(&none);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	return &attr;
+}
+
+pid_t spawnProcess(const char* path, char* const argv[], spawnStrategy strategy, 
+	const int* redirect) {
+	traceScope span(spawnNames[strategy]);
+	//children start with every signal unblocked, even when SIGCHLD is
+	//blocked in the interpreter for the signalfd.
+	if (strategy == SPAWN_POSIX) {
+		static posix_spawnattr_t* attr = defaultSpawnAttr();
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_t* actionsPtr = NULL;
+		if (redirect != NULL) {
+			posix_spawn_file_actions_init(&actions);
+			for (int i = 0; i < 2; i++) {
+				if (redirect[i] >= 0)
+					posix_spawn_file_actions_adddup2(&actions, redirect[i], i);
+			}
+			actionsPtr = &actions;
+		}
+		pid_t pid;
+		int err = posix_spawn(&pid, path, actionsPtr, attr, argv, environ);
+		if (actionsPtr != NULL)
+			posix_spawn_file_actions_destroy(actionsPtr);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+		return pid;
+	}
+
+	if (strategy == SPAWN_VFORK) {
+		//we are suspended until the child calls exec or exits, so nothing
+		//else can be using its stack or 'args' in the meantime. the stack
+		//	goes away with the thread, parallel workers launch programs too.
+		static thread_local unique_ptr<char[]> stack(new char[SPAWN_STACK_SIZE]);
+		vforkArgs args = { path, argv, redirect, 0 };
+		pid_t pid = clone(vforkChild, stack.get() + SPAWN_STACK_SIZE, 
+			CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+		if (pid == -1)
+			return -1;
+		if (args.error != 0) {
+			waitpid(pid, NULL, 0);
+			errno = args.error;
+			return -1;
+		}
+		return pid;
+	}
+
+	//fork has no shared memory, so the child reports an exec failure through
+	//a pipe that exec closes on success.
+	int p[2];
+	if (pipe2(p, O_CLOEXEC) == -1)
+		return -1;
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(p[0]);
+		prepareChild(redirect);
+		execve(path, argv, environ);
+		int err = errno;
+		//nothing more can be done in the child if this write fails.
+		ssize_t ignored = write(p[1], &err, sizeof(err));
+		(void)ignored;
+		_exit(127);
+	}
+	close(p[1]);
+	int err = 0;
+	if (pid != -1 && read(p[0], &err, sizeof(err)) == sizeof(err)) {
+		waitpid(pid, NULL, 0);
+		pid = -1;
+	}
+	int savedErrno = err ? err : errno;
+	close(p[0]);
+	errno = savedErrno;
+	return pid;
+}
+
+pid_t launchProcess(const char* path, char* const argv[], const int* redirect) {
+	for (int s = SPAWN_POSIX; s <= SPAWN_FORK; s++) {
+		pid_t pid = spawnProcess(path, argv, (spawnStrategy)s, redirect);
+		if (pid != -1)
+			return pid;
+		//these are about the program, a different strategy won't help.
+		if (errno == ENOENT || errno == EACCES || errno == ENOEXEC || errno == ENOTDIR ||
+			errno == ELOOP || errno == ENAMETOOLONG || errno == E2BIG || 
+			errno == ETXTBSY || errno == EISDIR || errno == EPERM)
+			return -1;
+	}
+	return -1;
+}
+
+const char* resolveCommand(const char* name, scratchArena &scratch) {
+	pathCache &cache = commandPaths;
+	lock_guard<mutex> guard(cache.lock);
+	const char* pathValue = getenv("PATH");
+	if (pathValue == NULL)
+		pathValue = "/usr/local/bin:/usr/bin:/bin";
+
+	//a new $PATH means new directories, nothing cached is trustworthy.
+	if (cache.pathValue != pathValue) {
+		cache.pathValue = pathValue;
+		cache.dirs.clear();
+		cache.entries.clear();
+		for (const char* p = pathValue; ; ) {
+			const char* end = strchr(p, ':');
+			pathDirectory dir;
+			dir.name.assign(p, end ? end - p : strlen(p));
+			//an empty entry means the current directory.
+			if (dir.name.empty())
+				dir.name = ".";
+			cache.dirs.push_back(dir);
+			if (end == NULL)
+				break;
+			p = end + 1;
+		}
+	}
+
+	struct stat st;
+	unordered_map<string, pathCacheEntry>::iterator iter = cache.entries.find(name);
+	if (iter != cache.entries.end()) {
+		//the entry holds as long as nothing was added, removed or renamed in
+		//its directory since it was found. the time is the entry's own, a
+		//	later lookup in the same directory doesn't vouch for it.
+		pathCacheEntry &entry = iter->second;
+		if (stat(cache.dirs[entry.dir].name.c_str(), &st) == 0 && 
+			st.st_mtim.tv_sec == entry.mtime.tv_sec && st.st_mtim.tv_nsec == entry.mtime.tv_nsec) {
+			iter->second.hits++;
+			return scratch.copy(iter->second.path.c_str(), iter->second.path.size());
+		}
+		cache.entries.erase(iter);
+	}
+
+	for (size_t i = 0; i < cache.dirs.size(); i++) {
+		pathDirectory &dir = cache.dirs[i];
+		string path = dir.name + "/" + name;
+		if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || access(path.c_str(), X_OK) != 0)
+			continue;
+		if (stat(dir.name.c_str(), &st) != 0)
+			continue;
+		pathCacheEntry entry;
+		entry.path = path;
+		entry.dir = i;
+		entry.mtime = st.st_mtim;
+		entry.hits = 1;
+		pathCacheEntry &stored = cache.entries[name];
+		stored = entry;
+		return scratch.copy(stored.path.c_str(), stored.path.size());
+	}
+	return NULL;
+}
+
+void forgetCommand(const char* name) {
+	lock_guard<mutex> guard(commandPaths.lock);
+	commandPaths.entries.erase(name);
+}
+
+pid_t launchProgram(const char* path, char* const argv[], const int* redirect) {
+	//the program writes straight to stdout, so what the commands before it
+	//printed has to come out first.
+	cout.flush();
+	pid_t pid = launchProcess(path, argv, redirect);
+	if (pid != -1 || errno != ENOEXEC)
+		return pid;
+
+	//a script without an interpreter line runs in the system shell, with the
+	//script's path in place of the program name.
+	vector<char*> shellArgv;
+	shellArgv.push_back((char*)"sh");
+	shellArgv.push_back((char*)path);
+	for (size_t i = 1; argv[i] != NULL; i++)
+		shellArgv.push_back(argv[i]);
+	shellArgv.push_back(NULL);
+	return launchProcess("/bin/sh", shellArgv.data(), redirect);
+}
+
+int captureProgram(const char* path, char* const argv[], vector<char> &out) {
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		return -1;
+	int redirect[2] = { -1, fds[1] };
+	pid_t pid = launchProgram(path, argv, redirect);
+	close(fds[1]);
+	if (pid == -1) {
+		int error = errno;
+		close(fds[0]);
+		errno = error;
+		return -1;
+	}
+
+	char buffer[16 << 10];
+	ssize_t n;
+	while ((n = read(fds[0], buffer, sizeof(buffer))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		out.insert(out.end(), buffer, buffer + n);
+	}
+	close(fds[0]);
+
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			return 0;
+	}
+	return status;
+}
+
+void spawnBenchmark(int iterations, int ballastMB) {
+	if (iterations < 1)
+		iterations = 1;
+	//touch every page so the ballast really is part of the RSS.
+	size_t ballastSize = (size_t)ballastMB << 20;
+	char* ballast = ballastSize ? new char[ballastSize] : NULL;
+	if (ballast != NULL)
+		memset(ballast, 1, ballastSize);
+
+	char path[] = "/bin/true";
+	char* argv[] = { path, NULL };
+	cout << "Launching " << path << " " << iterations << " times";
+	if (ballastMB > 0)
+		cout << " with " << ballastMB << " MB resident";
+	cout << " (latency in microseconds, until the child is reaped):\n";
+
+	for (int s = SPAWN_POSIX; s <= SPAWN_FORK; s++) {
+		vector<double> times;
+		for (int i = 0; i < iterations; i++) {
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			pid_t pid = spawnProcess(path, argv, (spawnStrategy)s);
+			if (pid == -1) {
+				cout << spawnNames[s] << ": " << strerror(errno) << ".\n";
+				break;
+			}
+			waitpid(pid, NULL, 0);
+			chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+			times.push_back(elapsed.count());
+		}
+		if (times.empty())
+			continue;
+
+		sort(times.begin(), times.end());
+		double total = 0;
+		for (size_t i = 0; i < times.size(); i++)
+			total += times[i];
+		cout << "\t" << spawnNames[s] << ": mean " << total / times.size()
+			 << ", p50 " << times[times.size() / 2]
+			 << ", p99 " << times[times.size() * 99 / 100] << "\n";
+	}
+	delete [] ballast;
+}
+
+void startupBenchmark(int iterations) {
+	if (iterations < 1)
+		iterations = 1;
+	char self[PATH_MAX];
+	ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (n == -1) {
+		cout << "Unable to find the smash binary: " << strerror(errno) << ".\n";
+		return;
+	}
+	self[n] = '\0';
+	char arg0[] = "smash", arg1[] = "-c", arg2[] = "quit";
+	char* argv[] = { arg0, arg1, arg2, NULL };
+	cout << "Starting " << self << " " << iterations << " times (latency in microseconds):\n";
+	cout.flush();
+
+	vector<double> ready, exited;
+	for (int i = 0; i < iterations; i++) {
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) == -1)
+			break;
+		//the child tells how long it took from this mark to its first command.
+		uint64_t start = monotonicNs();
+		char mark[32];
+		snprintf(mark, sizeof(mark), "%llu", (unsigned long long)start);
+		setenv(STARTUP_MARK_VARIABLE, mark, 1);
+		int redirect[2] = { -1, fds[1] };
+		pid_t pid = launchProcess(self, argv, redirect);
+		close(fds[1]);
+		if (pid == -1) {
+			cout << "Unable to run \"" << self << "\": " << strerror(errno) << ".\n";
+			close(fds[0]);
+			break;
+		}
+		uint64_t elapsed;
+		size_t got = 0;
+		while (got < sizeof(elapsed)) {
+			ssize_t r = read(fds[0], (char*)&elapsed + got, sizeof(elapsed) - got);
+			if (r <= 0 && errno != EINTR)
+				break;
+			if (r > 0)
+				got += r;
+		}
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		exited.push_back((monotonicNs() - start) / 1e3);
+		if (got == sizeof(elapsed))
+			ready.push_back(elapsed / 1e3);
+	}
+	unsetenv(STARTUP_MARK_VARIABLE);
+
+	const char* names[] = { "first command", "exit" };
+	vector<double>* times[] = { &ready, &exited };
+	for (int t = 0; t < 2; t++) {
+		vector<double> &v = *times[t];
+		if (v.empty())
+			continue;
+		sort(v.begin(), v.end());
+		double total = 0;
+		for (size_t i = 0; i < v.size(); i++)
+			total += v[i];
+		cout << "\t" << names[t] << ": mean " << total / v.size()
+			 << ", p50 " << v[v.size() / 2]
+			 << ", p99 " << v[v.size() * 99 / 100] << "\n";
+	}
+}
+
+void reportStartup() {
+	const char* mark = getenv(STARTUP_MARK_VARIABLE);
+	if (mark == NULL)
+		return;
+	uint64_t elapsed = monotonicNs() - strtoull(mark, NULL, 10);
+	writeAll(STDOUT_FILENO, (const char*)&elapsed, sizeof(elapsed));
+	//the programs it runs weren't started by the benchmark.
+	unsetenv(STARTUP_MARK_VARIABLE);
+}
+
+
+
+// -- Job Control --
+
+void initJobs() {
+	runningJobs.nextId = 1;
+	runningJobs.signalFd = -1;
+	runningJobs.epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+	//pidfd_open (Linux 5.3) gives each child a descriptor that becomes
+	//readable when it exits, probe it on ourselves.
+	runningJobs.usePidfd = false;
+#ifdef SYS_pidfd_open
+	int probe = syscall(SYS_pidfd_open, getpid(), 0);
+	if (probe != -1) {
+		close(probe);
+		runningJobs.usePidfd = true;
+	}
+#endif
+	if (!runningJobs.usePidfd) {
+		sigset_t child;
+		sigemptyset(&child);
+		sigaddset(&child, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &child, NULL);
+		runningJobs.signalFd = signalfd(-1, &child, SFD_CLOEXEC | SFD_NONBLOCK);
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(runningJobs.epollFd, EPOLL_CTL_ADD, runningJobs.signalFd, &ev);
+	}
+}
+
+job* addJob(const pid_t* pids, size_t count, string_view command, bool background) {
+	job* j;
+	if (runningJobs.spare.empty()) {
+		j = new job;
+	}
+	else {
+		j = runningJobs.spare.back();
+		runningJobs.spare.pop_back();
+	}
+	j->id = runningJobs.nextId++;
+	j->command.assign(command.data(), command.size());
+	j->pids.assign(pids, pids + count);
+	j->reaped.assign(count, false);
+	j->pidfds.clear();
+	j->remaining = count;
+	j->status = 0;
+	j->background = background;
+	memset(&j->usage, 0, sizeof(j->usage));
+	for (size_t i = 0; i < count; i++) {
+		int fd = -1;
+#ifdef SYS_pidfd_open
+		if (runningJobs.usePidfd)
+			fd = syscall(SYS_pidfd_open, pids[i], 0);
+#endif
+		if (fd != -1) {
+			epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.ptr = j;
+			epoll_ctl(runningJobs.epollFd, EPOLL_CTL_ADD, fd, &ev);
+		}
+		j->pidfds.push_back(fd);
+	}
+	runningJobs.jobs.push_back(j);
+	return j;
+}
+
+//Post:	Every process of 'j' that has exited has been reaped without blocking.
+static void reapJob(job* j) {
+	for (size_t i = 0; i < j->pids.size(); i++) {
+		if (j->reaped[i])
+			continue;
+		int status;
+		rusage usage;
+		if (wait4(j->pids[i], &status, WNOHANG, &usage) != j->pids[i])
+			continue;
+		addUsage(j->usage, usage);
+		if (i + 1 == j->pids.size())
+			j->status = status;
+		j->reaped[i] = true;
+		j->remaining--;
+		if (j->pidfds[i] != -1) {
+			epoll_ctl(runningJobs.epollFd, EPOLL_CTL_DEL, j->pidfds[i], NULL);
+			close(j->pidfds[i]);
+			j->pidfds[i] = -1;
+		}
+	}
+}
+
+void pollJobs(int timeoutMs) {
+	epoll_event events[16];
+	int n;
+	do {
+		n = epoll_wait(runningJobs.epollFd, events, 16, timeoutMs);
+	} while (n == -1 && errno == EINTR);
+
+	for (int e = 0; e < n; e++) {
+		job* j = (job*)events[e].data.ptr;
+		if (j != NULL) {
+			reapJob(j);
+			continue;
+		}
+		//a SIGCHLD doesn't say which child, and several may be merged into
+		//one, so every job is checked.
+		signalfd_siginfo info;
+		while (read(runningJobs.signalFd, &info, sizeof(info)) == sizeof(info))
+			;
+		for (size_t i = 0; i < runningJobs.jobs.size(); i++)
+			reapJob(runningJobs.jobs[i]);
+	}
+}
+
+void waitJob(job* j) {
+	reapJob(j);
+	while (j->remaining > 0)
+		pollJobs(-1);
+}
+
+void removeJob(job* j) {
+	for (size_t i = 0; i < j->pidfds.size(); i++) {
+		if (j->pidfds[i] != -1) {
+			epoll_ctl(runningJobs.epollFd, EPOLL_CTL_DEL, j->pidfds[i], NULL);
+			close(j->pidfds[i]);
+		}
+	}
+	if (!j->background) {
+		addUsage(runningJobs.foregroundUsage, j->usage);
+		runningJobs.foregroundPeak = max(runningJobs.foregroundPeak, j->usage.ru_maxrss);
+	}
+	runningJobs.jobs.erase(find(runningJobs.jobs.begin(), runningJobs.jobs.end(), j));
+	runningJobs.spare.push_back(j);
+}
+
+void reportJobs() {
+	//no syscall per line while there are no jobs.
+	if (runningJobs.jobs.empty())
+		return;
+	pollJobs(0);
+	for (size_t i = 0; i < runningJobs.jobs.size(); ) {
+		job* j = runningJobs.jobs[i];
+		if (j->background && j->remaining == 0) {
+			printJob(j);
+			removeJob(j);
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+job* findJob(int id) {
+	for (size_t i = 0; i < runningJobs.jobs.size(); i++) {
+		if (runningJobs.jobs[i]->id == id)
+			return runningJobs.jobs[i];
+	}
+	return NULL;
+}
+
+//Post:	The state of 'j' as jobs prints it has been written to 'state', and
+//			its length is returned.
+static int jobState(const job* j, char* state, size_t size) {
+	if (j->remaining > 0)
+		return snprintf(state, size, "Running");
+	if (WIFSIGNALED(j->status))
+		return snprintf(state, size, "Killed (%s)", strsignal(WTERMSIG(j->status)));
+	if (WEXITSTATUS(j->status) != 0)
+		return snprintf(state, size, "Exit %d", WEXITSTATUS(j->status));
+	return snprintf(state, size, "Done");
+}
+
+void printJob(const job* j) {
+	char state[64];
+	jobState(j, state, sizeof(state));
+	cout << "[" << j->id << "] " << state << "\t" << j->command << "\n";
+}
+
+void appendJobRecord(outputBuffer &out, const job* j, outputFormat format) {
+	if (format == FORMAT_NUL) {
+		char state[64];
+		int n = min(jobState(j, state, sizeof(state)), (int)sizeof(state) - 1);
+		appendNumber(out, j->id);
+		out.append("\t", 1);
+		out.append(state, n);
+		out.append("\t", 1);
+		out.append(j->command.data(), j->command.size());
+		out.append("", 1);
+		return;
+	}
+	const char* state = j->remaining > 0 ? "running" : WIFSIGNALED(j->status) ? "killed" : 
+		WEXITSTATUS(j->status) != 0 ? "exit" : "done";
+	int status = j->remaining > 0 ? 0 : WIFSIGNALED(j->status) ? WTERMSIG(j->status) : 
+		WEXITSTATUS(j->status);
+	out.append("{\"id\":", 6);
+	appendNumber(out, j->id);
+	out.append(",\"state\":\"", 10);
+	out.append(state, strlen(state));
+	out.append("\",\"status\":", 11);
+	appendNumber(out, status);
+	out.append(",\"pids\":[", 9);
+	for (size_t i = 0; i < j->pids.size(); i++) {
+		if (i > 0)
+			out.append(",", 1);
+		appendNumber(out, j->pids[i]);
+	}
+	out.append("],\"command\":\"", 13);
+	appendJsonChars(out, j->command.data(), j->command.size());
+	out.append("\"}\n", 3);
+}
+
+
+
+// -- Pipelines --
+
+bool parseRunStage(char** a, int len, pipeStage &stage, scratchArena &scratch) {
+	stage.teeFd = -1;
+	stage.pipeSize = 0;
+	stage.searched = false;
+	int i = 1;
+	if (i + 1 < len && strcmp(a[i], "-p") == 0) {
+		stage.pipeSize = parseSize(a[i + 1]);
+		if (stage.pipeSize <= 0) {
+			cout << "Invalid pipe size \"" << a[i + 1] << "\".\n";
+			return false;
+		}
+		i += 2;
+	}
+	if (i >= len) {
+		cout << "Invalid number of arguments.\n";
+		cout << "Usage: run [-p <pipe-size>] <executable-file> [<arguments>...] [&]\n";
+		return false;
+	}
+
+	//names without a directory are looked up in $PATH. there is no separate
+	//existence check, a missing program is reported by the launch itself.
+	stage.path = a[i];
+	if (strchr(a[i], '/') == NULL) {
+		stage.path = resolveCommand(a[i], scratch);
+		if (stage.path == NULL) {
+			cout << "Unable to find executable file \"" << a[i] << "\".\n";
+			return false;
+		}
+		stage.searched = true;
+	}
+	stage.argv = (char**)scratch.allocate((len - i + 1) * sizeof(char*), alignof(char*));
+	memcpy(stage.argv, a + i, (len - i) * sizeof(char*));
+	stage.argv[len - i] = NULL;
+	return true;
+}
+
+bool refreshStage(pipeStage &stage, scratchArena &scratch) {
+	//a cached path that is gone means the directory changed without its
+	//	mtime showing it, as when it changes twice within a timestamp tick.
+	if (!stage.searched)
+		return false;
+	forgetCommand(stage.argv[0]);
+	const char* path = resolveCommand(stage.argv[0], scratch);
+	if (path == NULL || strcmp(path, stage.path) == 0) {
+		errno = ENOENT;
+		return false;
+	}
+	stage.path = path;
+	return true;
+}
+
+void runPipeline(char** a, int len, scratchArena &scratch) {
+	bool background = len > 1 && strcmp(a[len - 1], "&") == 0;
+	if (background)
+		len--;
+
+	//split the line into its stages at each "|".
+	scratchVector<pipeStage> stages(scratch);
+	scratchString command(scratch);
+	for (int start = 0; start <= len; ) {
+		int end = start;
+		while (end < len && strcmp(a[end], "|") != 0)
+			end++;
+		pipeStage stage;
+		bool ok = false;
+		if (end > start && strcmp(a[start], "run") == 0) {
+			ok = parseRunStage(a + start, end - start, stage, scratch);
+		}
+		else if (end - start == 2 && strcmp(a[start], "tee") == 0 && !stages.empty()) {
+			stage.pipeSize = 0;
+			stage.searched = false;
+			stage.teeFd = open(a[start + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			ok = stage.teeFd != -1;
+			if (!ok)
+				cout << "Unable to open \"" << a[start + 1] << "\": " << strerror(errno) << ".\n";
+		}
+		else {
+			cout << "Invalid pipeline, each stage must be \"run ...\" or \"tee <file>\".\n";
+		}
+		if (!ok) {
+			for (size_t i = 0; i < stages.size(); i++) {
+				if (stages[i].teeFd != -1)
+					close(stages[i].teeFd);
+			}
+			return;
+		}
+		stages.push_back(stage);
+		for (int i = start; i < end; i++)
+			command.append(command.empty() ? "" : " ").append(a[i]);
+		if (end < len)
+			command += " |";
+		start = end + 1;
+	}
+
+	//every pipe is made before any stage starts, they are all close-on-exec
+	//so the programs only keep the two ends dup'ed onto their stdin/stdout.
+	scratchVector<int> pipeFds(scratch);
+	for (size_t i = 0; i + 1 < stages.size(); i++) {
+		int p[2];
+		if (pipe2(p, O_CLOEXEC) == -1) {
+			cout << "Unable to create a pipe: " << strerror(errno) << ".\n";
+			break;
+		}
+		if (stages[i].pipeSize > 0 && fcntl(p[1], F_SETPIPE_SZ, stages[i].pipeSize) == -1)
+			cout << "Unable to set the pipe size: " << strerror(errno) << ".\n";
+		pipeFds.push_back(p[0]);
+		pipeFds.push_back(p[1]);
+	}
+
+	scratchVector<pid_t> pids(scratch);
+	if (pipeFds.size() == (stages.size() - 1) * 2) {
+		for (size_t i = 0; i < stages.size(); i++) {
+			int redirect[2];
+			redirect[0] = (i > 0) ? pipeFds[(i - 1) * 2] : -1;
+			redirect[1] = (i + 1 < stages.size()) ? pipeFds[i * 2 + 1] : -1;
+			pid_t pid;
+			if (stages[i].teeFd != -1) {
+				pid = startTeeStage(redirect[0], redirect[1], stages[i].teeFd, pipeFds);
+			}
+			else {
+				pid = launchProgram(stages[i].path, stages[i].argv, redirect);
+				if (pid == -1 && errno == ENOENT && refreshStage(stages[i], scratch))
+					pid = launchProgram(stages[i].path, stages[i].argv, redirect);
+			}
+			if (pid == -1) {
+				//the stages around it see EOF or EPIPE once the pipes close.
+				cout << "Unable to start stage " << i + 1 << ": " << strerror(errno) << ".\n";
+				continue;
+			}
+			pids.push_back(pid);
+		}
+	}
+
+	for (size_t i = 0; i < pipeFds.size(); i++)
+		close(pipeFds[i]);
+	for (size_t i = 0; i < stages.size(); i++) {
+		if (stages[i].teeFd != -1)
+			close(stages[i].teeFd);
+	}
+	if (pids.empty())
+		return;
+
+	job* j = addJob(pids.data(), pids.size(), command, background);
+	if (background) {
+		cout << "[" << j->id << "] " << pids.back() << "\n";
+		return;
+	}
+	waitJob(j);
+	removeJob(j);
+}
+
+pid_t startTeeStage(int inFd, int outFd, int fileFd, const scratchVector<int> &pipeFds) {
+	//the stream is moved by the kernel, the child only drives the calls.
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+
+	for (size_t i = 0; i < pipeFds.size(); i++) {
+		if (pipeFds[i] != inFd && pipeFds[i] != outFd)
+			close(pipeFds[i]);
+	}
+	prepareChild(NULL);
+	_exit(teeStream(inFd, outFd == -1 ? STDOUT_FILENO : outFd, fileFd));
+}
+
+int teeStream(int inFd, int outFd, int fileFd) {
+	struct stat st;
+	bool outIsPipe = fstat(outFd, &st) == 0 && S_ISFIFO(st.st_mode);
+	char* buffer = NULL;
+	while (true) {
+		ssize_t n;
+		if (outIsPipe) {
+			//duplicate what's waiting in the input pipe into the output pipe
+			//without consuming it...
+			n = tee(inFd, outFd, TEE_CHUNK_SIZE, 0);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return n == 0 ? 0 : 1;
+			//...then move exactly that much from the input into the file.
+			for (ssize_t left = n; left > 0; ) {
+				ssize_t m = splice(inFd, NULL, fileFd, NULL, left, SPLICE_F_MOVE);
+				if (m == -1 && errno == EINTR)
+					continue;
+				if (m <= 0)
+					return 1;
+				left -= m;
+			}
+			continue;
+		}
+
+		//tee(2) needs two pipes, a terminal or file at the end of the
+		//pipeline gets a plain copy of each buffer.
+		if (buffer == NULL)
+			buffer = new char[COPY_BUFFER_SIZE];
+		n = read(inFd, buffer, COPY_BUFFER_SIZE);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n == 0 ? 0 : 1;
+		if (!writeAll(outFd, buffer, n) || !writeAll(fileFd, buffer, n))
+			return 1;
+	}
+}
+
+long parseSize(const char* text) {
+	char* end;
+	long size = strtol(text, &end, 10);
+	if (end == text || size < 0)
+		return -1;
+	if (*end == 'K' || *end == 'k')
+		size <<= 10;
+	else if (*end == 'M' || *end == 'm')
+		size <<= 20;
+	else if (*end == 'G' || *end == 'g')
+		size <<= 30;
+	else if (*end != '\0')
+		return -1;
+	if (*end != '\0' && end[1] != '\0')
+		return -1;
+	return size;
+}
+
+
+
+// -- Parallel Commands --
+
+void parallelWorker(parallelRun &run) {
+	scratchArena scratch;
+	vector<char> output;
+	size_t task;
+	while ((task = run.next.fetch_add(1)) < run.args.size()) {
+		int argc;
+		char** argv = parallelArguments(run, task, argc, scratch);
+		capturedOutput = &output;
+		run.fn(argv, argc, scratch);
+		capturedOutput = NULL;
+		scratch.reset();
+
+		lock_guard<mutex> guard(run.lock);
+		run.outputs[task].swap(output);
+		run.done[task] = 1;
+		run.finished.notify_all();
+	}
+}
+
+char** parallelArguments(const parallelRun &run, size_t task, int &len, scratchArena &scratch) {
+	const char* arg = run.args[task];
+	len = run.words.size() + (run.placeholder ? 0 : 1);
+	char** argv = (char**)scratch.allocate((len + 1) * sizeof(char*), alignof(char*));
+	//commands may change their words, so every run gets its own copies.
+	for (size_t w = 0; w < run.words.size(); w++) {
+		const char* word = run.words[w];
+		if (strstr(word, "{}") == NULL) {
+			argv[w] = scratch.copy(word, strlen(word));
+			continue;
+		}
+		scratchString replaced(scratch);
+		for (const char* p = word; *p != '\0'; ) {
+			const char* mark = strstr(p, "{}");
+			if (mark == NULL) {
+				replaced.append(p);
+				break;
+			}
+			replaced.append(p, mark - p).append(arg);
+			p = mark + 2;
+		}
+		argv[w] = scratch.copy(replaced.data(), replaced.size());
+	}
+	if (!run.placeholder)
+		argv[run.words.size()] = scratch.copy(arg, strlen(arg));
+	argv[len] = NULL;
+	return argv;
+}
+
+bool readArgumentFile(const char* file, vector<char*> &args, scratchArena &scratch) {
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		cout << "Unable to open \"" << file << "\": " << strerror(errno) << ".\n";
+		return false;
+	}
+	scratchVector<char> text(scratch);
+	char buffer[16 << 10];
+	ssize_t n;
+	while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			cout << "Unable to read \"" << file << "\": " << strerror(errno) << ".\n";
+			close(fd);
+			return false;
+		}
+		text.insert(text.end(), buffer, buffer + n);
+	}
+	close(fd);
+	text.push_back('\n');
+
+	//the text stays in the scratch memory, each line ends at its newline.
+	char* begin = text.data();
+	char* end = begin + text.size();
+	for (char* line = begin; line < end; ) {
+		char* newline = (char*)memchr(line, '\n', end - line);
+		*newline = '\0';
+		if (newline > line && newline[-1] == '\r')
+			newline[-1] = '\0';
+		if (*line != '\0')
+			args.push_back(line);
+		line = newline + 1;
+	}
+	return true;
+}
+
+// -- Scratch Memory --
+
+atomic<uint64_t> heapAllocations(0);
+
+//every allocation of the program is counted, the arena's blocks as well.
+void* operator new(size_t n) {
+	heapAllocations.fetch_add(1, memory_order_relaxed);
+	void* p = malloc(n == 0 ? 1 : n);
+	if (p == NULL)
+		throw bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t n) {
+	return operator new(n);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	free(p);
+}
+
+scratchArena::~scratchArena() {
+	for (size_t i = 0; i < blocks.size(); i++)
+		delete [] blocks[i].first;
+}
+
+void* scratchArena::allocate(size_t n, size_t align) {
+	while (current < blocks.size()) {
+		uintptr_t base = (uintptr_t)blocks[current].first;
+		size_t start = ((base + used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+		if (start + n <= blocks[current].second) {
+			used = start + n;
+			return blocks[current].first + start;
+		}
+		current++;
+		used = 0;
+	}
+	//each new block is at least as big as all of the others together.
+	size_t size = SCRATCH_BLOCK_SIZE;
+	for (size_t i = 0; i < blocks.size(); i++)
+		size += blocks[i].second;
+	while (size < n + align)
+		size *= 2;
+	blocks.push_back(make_pair(new char[size], size));
+	current = blocks.size() - 1;
+	used = 0;
+	return allocate(n, align);
+}
+
+char* scratchArena::copy(const char* s, size_t n) {
+	char* p = (char*)allocate(n + 1, 1);
+	memcpy(p, s, n);
+	p[n] = '\0';
+	return p;
+}
+
+void scratchArena::reset() {
+	size_t size = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+		size += blocks[i].second;
+	if (blocks.size() > 1 || size > SCRATCH_KEEP_SIZE) {
+		for (size_t i = 0; i < blocks.size(); i++)
+			delete [] blocks[i].first;
+		blocks.clear();
+		if (size > SCRATCH_KEEP_SIZE)
+			size = SCRATCH_BLOCK_SIZE;
+		blocks.push_back(make_pair(new char[size], size));
+	}
+	current = 0;
+	used = 0;
+}
+
+// -- Instrumentation --
+
+statsTable commandCounters;
+
+uint64_t monotonicNs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void recordCommand(string_view name, bool piped, uint64_t ns, uint64_t allocations) {
+	commandStats* stats;
+	int slot = builtinIndex(name);
+	if (piped && slot != builtinIndex("time")) {
+		stats = &commandCounters.pipelines;
+	}
+	else if (slot >= 0) {
+		stats = &commandCounters.builtins[slot];
+	}
+	else {
+		//the line's own copy of the name is gone after this line, the key
+		//has to be the registered one.
+		unordered_map<string_view, function>::iterator iter = extraCommands.entries.find(name);
+		if (iter == extraCommands.entries.end())
+			return;
+		stats = &commandCounters.extra[iter->first];
+	}
+	stats->calls++;
+	stats->totalNs += ns;
+	stats->maxNs = max(stats->maxNs, ns);
+	stats->allocations += allocations;
+	//the bucket is the bit length of the time in microseconds.
+	uint64_t us = ns / 1000;
+	int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	stats->buckets[min(bucket, STATS_BUCKETS - 1)]++;
+}
+
+void printStats(string_view name, const commandStats &stats) {
+	if (stats.calls == 0)
+		return;
+	char line[160];
+	snprintf(line, sizeof(line), "%-12.*s %10llu %12.3f %12.1f %12.1f %12.1f\n", (int)name.size(), 
+		name.data(), (unsigned long long)stats.calls, stats.totalNs / 1e6, 
+		stats.totalNs / 1e3 / stats.calls, stats.maxNs / 1e3, 
+		(double)stats.allocations / stats.calls);
+	cout << line;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		if (stats.buckets[i] == 0)
+			continue;
+		if (i == 0)
+			snprintf(line, sizeof(line), "%14s <1us: %llu\n", "", (unsigned long long)stats.buckets[i]);
+		else
+			snprintf(line, sizeof(line), "%14s %llu-%lluus: %llu\n", "", 1ull << (i - 1), 
+				1ull << i, (unsigned long long)stats.buckets[i]);
+		cout << line;
+	}
+}
+
+void appendStatsRecord(outputBuffer &out, string_view name, const commandStats &stats, 
+	outputFormat format) {
+	if (stats.calls == 0)
+		return;
+	if (format == FORMAT_NUL) {
+		out.append(name.data(), name.size());
+		const uint64_t values[] = { stats.calls, stats.totalNs, stats.maxNs, stats.allocations };
+		for (uint64_t value : values) {
+			out.append("\t", 1);
+			appendNumber(out, value);
+		}
+		out.append("", 1);
+		return;
+	}
+	out.append("{\"command\":\"", 12);
+	appendJsonChars(out, name.data(), name.size());
+	out.append("\",\"calls\":", 10);
+	appendNumber(out, stats.calls);
+	out.append(",\"total_ns\":", 12);
+	appendNumber(out, stats.totalNs);
+	out.append(",\"max_ns\":", 10);
+	appendNumber(out, stats.maxNs);
+	out.append(",\"allocations\":", 15);
+	appendNumber(out, stats.allocations);
+	out.append(",\"histogram\":[", 14);
+	bool first = true;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		if (stats.buckets[i] == 0)
+			continue;
+		if (!first)
+			out.append(",", 1);
+		first = false;
+		out.append("{\"min_us\":", 10);
+		appendNumber(out, i == 0 ? 0 : 1ll << (i - 1));
+		out.append(",\"max_us\":", 10);
+		appendNumber(out, 1ll << i);
+		out.append(",\"calls\":", 9);
+		appendNumber(out, stats.buckets[i]);
+		out.append("}", 1);
+	}
+	out.append("]}\n", 3);
+}
+
+void addUsage(rusage &total, const rusage &u) {
+	total.ru_utime.tv_sec += u.ru_utime.tv_sec;
+	total.ru_utime.tv_usec += u.ru_utime.tv_usec;
+	if (total.ru_utime.tv_usec >= 1000000) {
+		total.ru_utime.tv_sec++;
+		total.ru_utime.tv_usec -= 1000000;
+	}
+	total.ru_stime.tv_sec += u.ru_stime.tv_sec;
+	total.ru_stime.tv_usec += u.ru_stime.tv_usec;
+	if (total.ru_stime.tv_usec >= 1000000) {
+		total.ru_stime.tv_sec++;
+		total.ru_stime.tv_usec -= 1000000;
+	}
+	total.ru_maxrss = max(total.ru_maxrss, u.ru_maxrss);
+	total.ru_minflt += u.ru_minflt;
+	total.ru_majflt += u.ru_majflt;
+	total.ru_nvcsw += u.ru_nvcsw;
+	total.ru_nivcsw += u.ru_nivcsw;
+}
+
+
+
+// -- Tracing --
+
+atomic<bool> tracingEnabled(false);
+//holds the rings of every thread that recorded a span. rings are never
+//	freed, a dump can read them while their threads exit.
+static mutex traceRingsLock;
+static vector<traceRing*> traceRings;
+//holds when "trace clear" was run, older spans aren't dumped.
+static atomic<uint64_t> traceSince(0);
+
+//the calling thread's ring, given back for reuse when the thread exits.
+struct traceOwner {
+	traceRing* ring;
+	int32_t tid;
+
+	~traceOwner() {
+		if (ring != NULL)
+			ring->inUse.store(false, memory_order_release);
+	}
+};
+
+static thread_local traceOwner traceThread = { NULL, 0 };
+
+//Post:	'owner' holds a ring, an unused one or a new one.
+static void acquireRing(traceOwner &owner) {
+	owner.tid = syscall(SYS_gettid);
+	lock_guard<mutex> guard(traceRingsLock);
+	for (size_t i = 0; i < traceRings.size(); i++) {
+		bool expected = false;
+		if (traceRings[i]->inUse.compare_exchange_strong(expected, true, memory_order_acquire)) {
+			owner.ring = traceRings[i];
+			return;
+		}
+	}
+	traceRing* ring = new traceRing;
+	ring->head.store(0, memory_order_relaxed);
+	ring->inUse.store(true, memory_order_relaxed);
+	traceRings.push_back(ring);
+	owner.ring = ring;
+}
+
+void recordSpan(string_view name, uint64_t start, uint64_t end, int64_t arg) {
+	traceOwner &owner = traceThread;
+	if (owner.ring == NULL)
+		acquireRing(owner);
+	traceRing* ring = owner.ring;
+	uint64_t head = ring->head.load(memory_order_relaxed);
+	traceSpan &span = ring->spans[head & (TRACE_RING_SPANS - 1)];
+	span.start = start;
+	span.end = end;
+	span.arg = arg;
+	span.tid = owner.tid;
+	size_t n = min(name.size(), (size_t)TRACE_NAME_SIZE - 1);
+	memcpy(span.name, name.data(), n);
+	span.name[n] = '\0';
+	//a dump that sees the new head sees the span.
+	ring->head.store(head + 1, memory_order_release);
+}
+
+void clearTrace() {
+	traceSince.store(monotonicNs(), memory_order_relaxed);
+}
+
+//Post:	The spans of every ring that started after the last clear have been
+//			copied to 'spans', sorted by thread and then by start.
+static void collectSpans(vector<traceSpan> &spans) {
+	uint64_t since = traceSince.load(memory_order_relaxed);
+	lock_guard<mutex> guard(traceRingsLock);
+	for (size_t r = 0; r < traceRings.size(); r++) {
+		traceRing* ring = traceRings[r];
+		uint64_t head = ring->head.load(memory_order_acquire);
+		uint64_t first = head > TRACE_RING_SPANS ? head - TRACE_RING_SPANS : 0;
+		size_t copied = spans.size();
+		for (uint64_t i = first; i < head; i++)
+			spans.push_back(ring->spans[i & (TRACE_RING_SPANS - 1)]);
+		//the owner kept recording while we copied, the oldest slots may
+		//	have been rewritten under us. the slot of the new head may be
+		//	half written too.
+		uint64_t now = ring->head.load(memory_order_acquire);
+		uint64_t valid = now >= TRACE_RING_SPANS ? now - TRACE_RING_SPANS + 1 : 0;
+		size_t keep = copied;
+		for (uint64_t i = first; i < head; i++) {
+			const traceSpan &span = spans[copied + (i - first)];
+			if (i >= valid && span.start >= since)
+				spans[keep++] = span;
+		}
+		spans.resize(keep);
+	}
+	//a parent ends after its children, so it goes first among equal starts.
+	sort(spans.begin(), spans.end(), [](const traceSpan &x, const traceSpan &y) {
+		if (x.tid != y.tid)
+			return x.tid < y.tid;
+		if (x.start != y.start)
+			return x.start < y.start;
+		return x.end > y.end;
+	});
+}
+
+//Post:	'spans' has been appended to 'out' as one Chrome trace event (a
+//			complete "X" event) per line, in microseconds.
+static void appendChromeTrace(outputBuffer &out, const vector<traceSpan> &spans) {
+	uint64_t epoch = spans.empty() ? 0 : spans[0].start;
+	for (size_t i = 0; i < spans.size(); i++)
+		epoch = min(epoch, spans[i].start);
+	pid_t pid = getpid();
+	out.append("{\"traceEvents\":[\n", 17);
+	for (size_t i = 0; i < spans.size(); i++) {
+		const traceSpan &span = spans[i];
+		char times[96];
+		int n = snprintf(times, sizeof(times), ",\"ts\":%.3f,\"dur\":%.3f,\"pid\":", 
+			(span.start - epoch) / 1e3, (span.end - span.start) / 1e3);
+		out.append("{\"name\":\"", 9);
+		appendJsonChars(out, span.name, strlen(span.name));
+		out.append("\",\"ph\":\"X\"", 10);
+		out.append(times, n);
+		appendNumber(out, pid);
+		out.append(",\"tid\":", 7);
+		appendNumber(out, span.tid);
+		if (span.arg != 0) {
+			out.append(",\"args\":{\"arg\":", 15);
+			appendNumber(out, span.arg);
+			out.append("}", 1);
+		}
+		out.append(i + 1 < spans.size() ? "},\n" : "}\n", i + 1 < spans.size() ? 3 : 2);
+	}
+	out.append("],\"displayTimeUnit\":\"ns\"}\n", 26);
+}
+
+//Post:	'spans' has been appended to 'out' as folded stacks, each path of
+//			nested spans followed by the microseconds spent in it and not
+//			in a span under it.
+static void appendFoldedStacks(outputBuffer &out, const vector<traceSpan> &spans) {
+	vector<pair<string, uint64_t> > stacks;
+	//the spans of one thread nest, so the ones still open contain the next.
+	vector<size_t> open;
+	vector<uint64_t> self(spans.size());
+	for (size_t i = 0; i < spans.size(); i++) {
+		const traceSpan &span = spans[i];
+		while (!open.empty() && (spans[open.back()].tid != span.tid || 
+			spans[open.back()].end <= span.start))
+			open.pop_back();
+		self[i] = span.end - span.start;
+		if (!open.empty()) {
+			uint64_t &parent = self[open.back()];
+			parent -= min(parent, span.end - span.start);
+		}
+		string path;
+		for (size_t j = 0; j < open.size(); j++) {
+			path += spans[open[j]].name;
+			path += ';';
+		}
+		path += span.name;
+		stacks.push_back(make_pair(path, i));
+		open.push_back(i);
+	}
+	//the self times are only known once the children have been seen.
+	for (size_t i = 0; i < stacks.size(); i++)
+		stacks[i].second = self[stacks[i].second];
+	sort(stacks.begin(), stacks.end());
+	for (size_t i = 0; i < stacks.size(); ) {
+		size_t j = i;
+		uint64_t ns = 0;
+		for (; j < stacks.size() && stacks[j].first == stacks[i].first; j++)
+			ns += stacks[j].second;
+		if (ns >= 1000) {
+			out.append(stacks[i].first.data(), stacks[i].first.size());
+			out.append(" ", 1);
+			appendNumber(out, ns / 1000);
+			out.append("\n", 1);
+		}
+		i = j;
+	}
+}
+
+void dumpTrace(outputBuffer &out, bool folded) {
+	vector<traceSpan> spans;
+	collectSpans(spans);
+	if (folded)
+		appendFoldedStacks(out, spans);
+	else
+		appendChromeTrace(out, spans);
+}
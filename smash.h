@@ -0,0 +1,1691 @@
+/******************************************************************
+*
+*	Sam Opdahl
+*	Smash Interpreter
+*
+*	The constants, types and function headers shared by the
+*	interpreter (main.cpp), its commands (smash.cpp) and the
+*	benchmarks (bench/smash_bench.cpp).
+*
+*******************************************************************/
+#ifndef SMASH_H
+#define SMASH_H
+
+#include <iostream>
+#include <string.h>
+#include <cstdlib>
+#include <fstream>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include <string_view>
+#include <memory>
+#include <cstdint>
+#include <dlfcn.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "smash_plugin.h"
+
+using namespace std;
+
+//the per-command scratch memory, see Scratch Memory below.
+struct scratchArena;
+
+//a type definition used with the command dispatch tables.
+//each function will be passed the array of cstrings, the array's 
+//	length and the command's scratch memory, and they will return void type.
+typedef void (*function)(char**, int, scratchArena&);
+
+
+// -- Constants/Globals -- 
+
+//holds the initial size of the input line buffer, it grows for longer lines.
+#define INPUT_BUFFER_SIZE 4096
+//holds the size of the line buffer when commands are piped in, so a batch
+//	of thousands of commands only takes a few reads.
+#define BATCH_BUFFER_SIZE (1 << 20)
+//holds the largest amount of bytes a single kernel copy call will be asked
+//	to move. keeps each syscall bounded so huge files are copied in slices.
+#define COPY_CHUNK_SIZE (1 << 30)
+//holds the size of the pipe used when the copy engine falls back to splice.
+#define SPLICE_PIPE_SIZE (1 << 20)
+//holds the size of the user space buffer used by the final read/write fallback.
+#define COPY_BUFFER_SIZE (1 << 17)
+//holds the size of each offset range handed to a parallel copy thread.
+#define PARALLEL_CHUNK_SIZE (8 << 20)
+//holds how much of the source the mmap stage maps at once, a multiple of
+//	MMAP_ALIGN so every window starts on a huge page boundary.
+#define MMAP_WINDOW_SIZE (64 << 20)
+//holds the alignment of the mmap stage's windows and writes (a huge page).
+#define MMAP_ALIGN (2 << 20)
+//holds the size of each block a direct I/O copy moves with one read/write.
+#define DIRECT_BLOCK_SIZE (1 << 20)
+//holds the alignment of direct I/O buffers, offsets and lengths. 4K covers
+//	both 512 byte and 4K sector devices.
+#define DIRECT_ALIGN 4096
+//holds the amount of blocks a direct I/O copy keeps in flight by default.
+#define DIRECT_QUEUE_DEPTH 4
+//holds the size above which a copy drops the pages it is done with from
+//	the page cache, so it doesn't evict everything else.
+#define CACHE_DROP_THRESHOLD (64 << 20)
+//holds the size of the blocks an updating copy compares and rewrites.
+#define DELTA_BLOCK_SIZE (64 << 10)
+//holds how much of both files an updating copy reads at a time, a multiple
+//	of DELTA_BLOCK_SIZE.
+#define DELTA_READ_SIZE (1 << 20)
+//holds the amount of threads comparing blocks when -j isn't given.
+#define DELTA_JOBS 4
+//holds how often the live throughput of a parallel copy is printed, in ms.
+#define PROGRESS_INTERVAL_MS 250
+//holds the amount of files the directory walker may queue ahead of the copiers.
+#define COPY_QUEUE_SIZE 4096
+//holds the amount of submission queue entries in each io_uring.
+#define URING_ENTRIES 256
+//holds the amount of files a copier thread batches into one round of
+//	io_uring submissions. each file uses up to 3 entries per round.
+#define URING_BATCH_FILES 64
+//holds the largest file that is copied entirely through io_uring. larger
+//	files are handed to the regular copy engine.
+#define URING_SMALL_FILE (64 << 10)
+//holds the size of the buffer getdents64 fills with directory entries.
+#define DIRENT_BUFFER_SIZE (1 << 20)
+//holds the size of the buffer that listing output is formatted into before
+//	it is handed to write(2).
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+//holds the size of the ring buffer in front of stdout.
+#define SINK_BUFFER_SIZE (1 << 20)
+//holds how much output waits in the ring before it is written out.
+#define SINK_FLUSH_THRESHOLD (64 << 10)
+//holds how long the writer thread lets a smaller amount wait.
+#define SINK_LATENCY_MS 50
+//holds the amount of entries whose metadata is fetched in one batch.
+#define STATX_BATCH_SIZE 256
+//holds the amount of directories the listing cache keeps, the least
+//	recently listed one makes room.
+#define LIST_CACHE_SIZE 64
+//holds how old a directory's mtime has to be before it is cached without
+//	an inotify watch, so a change in the same tick isn't missed.
+#define LIST_CACHE_SETTLE_SECONDS 2
+//holds the pattern offset of a word that is its own pattern.
+#define NO_PATTERN ((size_t)-1)
+//holds how many times an idle walker thread looks for work to steal before
+//	it starts sleeping between attempts.
+#define WALK_STEAL_SPINS 64
+//holds the most commands parallel runs at the same time.
+#define PARALLEL_MAX_JOBS 1024
+//holds the size of the stack a clone(CLONE_VM | CLONE_VFORK) child runs on
+//	until it calls exec.
+#define SPAWN_STACK_SIZE (64 << 10)
+//holds the amount of launches each strategy is timed with by --spawn-bench.
+#define SPAWN_BENCH_ITERATIONS 2000
+//holds the amount of times --startup-bench starts the interpreter.
+#define STARTUP_BENCH_ITERATIONS 1000
+//holds the environment variable --startup-bench passes the launch time in,
+//	in CLOCK_MONOTONIC nanoseconds.
+#define STARTUP_MARK_VARIABLE "SMASH_STARTUP_MARK"
+//holds the amount of spans each thread's trace ring keeps, a power of two.
+#define TRACE_RING_SPANS 8192
+//holds the longest span name kept, with its NUL.
+#define TRACE_NAME_SIZE 24
+//holds the most bytes a tee stage duplicates with one tee(2) call.
+#define TEE_CHUNK_SIZE (1 << 20)
+//Holds the prompt that will display to the user
+#define PROMPT "user@smash $ "
+//Version number of the program
+#define PROGRAM_VERSION "1.0"
+//holds the amount of slots in the builtin command hash table, a power of two.
+#define DISPATCH_TABLE_SIZE 32
+//holds where plugins are looked for when $SMASH_PLUGIN_PATH isn't set,
+//	relative to $HOME.
+#define PLUGIN_DEFAULT_DIR "/.smash/plugins"
+//holds the amount of power of two latency buckets kept per command, the
+//	first is under 1us and the last holds everything above ~4s.
+#define STATS_BUCKETS 24
+//holds the size of the first block of a command's scratch memory.
+#define SCRATCH_BLOCK_SIZE (64 << 10)
+//holds the most scratch memory kept after a command, a bigger one goes back
+//	to the heap so one huge listing doesn't stay resident.
+#define SCRATCH_KEEP_SIZE (16 << 20)
+//holds the size of the reads used to hash and verify files.
+#define HASH_BUFFER_SIZE (1 << 20)
+//hold the XXH3 stripe, block and secret layout, a block is
+//	XXH3_BLOCK_STRIPES stripes and the secret advances 8 bytes per stripe.
+#define XXH3_STRIPE_LEN 64
+#define XXH3_SECRET_SIZE 192
+#define XXH3_BLOCK_STRIPES ((XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / 8)
+//holds the longest input hashed without the stripe accumulators.
+#define XXH3_MIDSIZE_MAX 240
+//holds the secret bytes used by the 129 to 240 byte path.
+#define XXH3_MIDSIZE_SECRET 136
+//holds how much input a streaming hash buffers, a multiple of a stripe.
+#define XXH3_BUFFER_SIZE 256
+
+
+// -- Function Headers --
+
+// * Command Functions *
+
+//	~Pre/Post conditions below apply to all *_cmd functions~
+//Pre:	'a' is the array of cstrings to be evaluated and
+//			'len' is that value that hold 'a's length.
+//		'scratch' is memory for the command to use until it returns.
+//Post:	An error message is printed if the user entered an invalid number of 
+//			params, excluding help and quit commands.
+//		This is on top of what each individual command does, as described below.
+
+//Post: A help message has been printed to the user
+void help_cmd(char** a, int len, scratchArena &scratch);
+
+//Post: the program has closed.
+void quit_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	Creates a copy of the source file.
+//		If the source file doesn't exist or the destination file already exists,
+//			A warning will be pritned to the user.
+//		With "-j N" the file is copied in offset ranges by N threads and the
+//			throughput is reported.
+//		With "-r" a directory tree is copied, using "-j N" copier threads.
+void copy_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	the contents of the current or specified directory have been 
+//		listed to the user.
+//		"-l" adds the mode, size and modification time of each entry and
+//			"-s" sorts the entries by name.
+//		"-R" lists the whole tree with a pool of walker threads, "-u" prints
+//			it in whatever order the threads finish for the fastest output.
+//		"--json" prints a JSON object per entry and "-0" ends each one with
+//			a NUL instead of a newline.
+void list_cmd(char** a, int len, scratchArena &scratch);
+
+//Post: The specified program has been run, and this program will wait for 
+//			the new child process to finish executing.
+//		Names without a '/' are looked up in $PATH and the arguments after the
+//			name are passed to the program.
+//		A trailing "&" runs the program as a background job instead.
+//		"-p <size>" sets the buffer size of the pipe out of the program when
+//			it is a stage of a pipeline.
+void run_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	The background jobs and their states have been printed, as JSON
+//			objects with "--json" or NUL terminated records with "-0".
+void jobs_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	The interpreter has waited for the given background job, or for all
+//			of them when no job number was given.
+void wait_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	The given job, or the most recent one, has been brought to the
+//			foreground and waited for.
+void fg_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	The programs remembered by the $PATH lookup cache have been printed,
+//			or with "-r" the cache has been emptied.
+//		Given file names, the XXH3-64 checksum of each file is printed instead.
+void hash_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	"alias <name> <command>" makes 'name' run 'command', and "alias" lists
+//			the aliases.
+void alias_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	"time <command>" has run the command and printed its wall, user and
+//			sys time, maximum RSS, page faults and context switches. For
+//			programs these are the children's, for builtins the interpreter's
+//			and the RSS is the interpreter's peak so far.
+void time_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	"trace on" and "trace off" have started and stopped recording spans,
+//			and "trace clear" has dropped the ones recorded so far.
+//		"trace dump [--folded] [<file>]" has written the recorded spans as
+//			Chrome trace events, or with "--folded" as folded stacks for
+//			flamegraph.pl, to the file or the output.
+void trace_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	The calls, total time and latency histogram of each command run so
+//			far have been printed, or with "-r" they have been reset.
+//		"--json" prints a JSON object per command and "-0" NUL terminated
+//			records of tab separated counters.
+void stats_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	"plugin load <file>" has loaded a plugin right away, and "plugin" has
+//			listed the loaded plugins and the commands they added.
+void plugin_cmd(char** a, int len, scratchArena &scratch);
+
+//Post:	"parallel [-j <jobs>] <command> ::: <argument>..." has run the command
+//			once for each argument on a pool of threads, with "{}" in its
+//			words replaced by the argument or the argument appended. With
+//			":::: <file>" the arguments are the lines of the file.
+//		The output of each run is printed in the order of the arguments.
+void parallel_cmd(char** a, int len, scratchArena &scratch);
+
+// * Command Dispatch *
+
+//a builtin command word and its function.
+struct builtinCommand {
+	string_view name;
+	function fn;
+};
+
+//these will assign each command word to their command function in the program.
+constexpr builtinCommand builtinCommands[] = {
+	{ "help", help_cmd },
+	{ "quit", quit_cmd },
+	{ "copy", copy_cmd },
+	{ "list", list_cmd },
+	{ "run", run_cmd },
+	{ "hash", hash_cmd },
+	{ "jobs", jobs_cmd },
+	{ "wait", wait_cmd },
+	{ "fg", fg_cmd },
+	{ "alias", alias_cmd },
+	{ "plugin", plugin_cmd },
+	{ "time", time_cmd },
+	{ "stats", stats_cmd },
+	{ "parallel", parallel_cmd },
+	{ "trace", trace_cmd },
+};
+constexpr size_t BUILTIN_COUNT = sizeof(builtinCommands) / sizeof(builtinCommands[0]);
+
+//Post:	The seeded FNV-1a hash of 'name' is returned. the low bits of FNV
+//			only depend on the low bits of the input, so they are mixed with
+//			the high ones before the table slot is taken from them.
+constexpr uint32_t commandHash(string_view name, uint32_t seed) {
+	uint32_t h = 2166136261u ^ seed;
+	for (size_t i = 0; i < name.size(); i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	return h;
+}
+
+//the builtin hash table, each slot holds an index into 'builtinCommands'
+//	or -1. it is filled in by the compiler, so startup does no work.
+struct dispatchTable {
+	uint32_t seed;
+	int8_t slots[DISPATCH_TABLE_SIZE];
+};
+
+//Post:	A table where no two builtins share a slot is returned, the seed is
+//			searched for at compile time.
+constexpr dispatchTable buildDispatchTable() {
+	for (uint32_t seed = 0; ; seed++) {
+		dispatchTable table = { seed, {} };
+		for (size_t i = 0; i < DISPATCH_TABLE_SIZE; i++)
+			table.slots[i] = -1;
+		bool perfect = true;
+		for (size_t i = 0; i < BUILTIN_COUNT && perfect; i++) {
+			uint32_t slot = commandHash(builtinCommands[i].name, seed) & (DISPATCH_TABLE_SIZE - 1);
+			perfect = table.slots[slot] == -1;
+			table.slots[slot] = i;
+		}
+		if (perfect)
+			return table;
+	}
+}
+
+constexpr dispatchTable builtinDispatch = buildDispatchTable();
+static_assert(BUILTIN_COUNT <= DISPATCH_TABLE_SIZE, "DISPATCH_TABLE_SIZE is too small");
+
+//commands registered while running, by aliases and plugins. the names
+//	are owned by 'names' so the map can be searched with a string_view.
+struct commandTable {
+	deque<string> names;
+	unordered_map<string_view, function> entries;
+	//what each alias was made from, for listing them.
+	vector<pair<string_view, string> > aliases;
+	//the command words that have no plugin, so a mistyped command only
+	//	searches the plugin directories once.
+	unordered_map<string_view, bool> missing;
+	//the handles and paths of the loaded plugins.
+	deque<pair<void*, string> > plugins;
+	//the plugin being initialised, the commands it registers are its own.
+	const string* loadingPlugin;
+	//which plugin each command came from.
+	unordered_map<string_view, const string*> owners;
+	//the plugin function behind each name that runs pluginCommand.
+	unordered_map<string_view, smash_command> external;
+};
+
+//holds the commands that aren't builtin.
+extern commandTable extraCommands;
+
+//Post:	The function for the command word 'name' is returned, or NULL if it
+//			isn't a command. Builtins are found with one hash and compare.
+function findCommand(string_view name);
+
+//Post:	The index of 'name' in 'builtinCommands' is returned, or -1.
+int builtinIndex(string_view name);
+
+//Pre:	'a' holds the 'len' words of a command, 'piped' is true if one of
+//			them is an unquoted "|".
+//Post:	The command or pipeline has been run, or an error printed if it
+//			isn't one. true is returned if it was found.
+//		'scratch' is handed to the command, the caller resets it.
+bool runCommand(char** a, int len, bool piped, scratchArena &scratch);
+
+// * Scratch Memory *
+
+//a bump allocator for the scratch memory of one command. nothing taken from
+//	it is freed on its own, the main loop resets it after each command and
+//	the blocks are used again, so a command that ran before doesn't need
+//	the heap. after a command that needed more than one block, they are
+//	merged into one big enough for all of it.
+struct scratchArena {
+	//the blocks and their sizes, memory is taken from blocks[current].
+	vector<pair<char*, size_t> > blocks;
+	size_t current;
+	size_t used;
+
+	scratchArena() : current(0), used(0) {}
+	~scratchArena();
+	//Post:	'n' bytes aligned to 'align' (a power of two) are returned.
+	void* allocate(size_t n, size_t align = alignof(max_align_t));
+	//Post:	A NUL terminated copy of the 'n' bytes of 's' is returned.
+	char* copy(const char* s, size_t n);
+	//Post:	Everything allocated has been given back.
+	void reset();
+};
+
+//a standard allocator handing out scratch memory, for containers that
+//	only live as long as the command. a default constructed one uses the
+//	heap, so a type can hold either.
+template <typename T>
+struct scratchAllocator {
+	typedef T value_type;
+	scratchArena* arena;
+
+	//without an arena the memory comes from the heap.
+	scratchAllocator() : arena(NULL) {}
+	scratchAllocator(scratchArena &arena) : arena(&arena) {}
+	template <typename U>
+	scratchAllocator(const scratchAllocator<U> &other) : arena(other.arena) {}
+	T* allocate(size_t n) { 
+		if (arena == NULL)
+			return (T*)::operator new(n * sizeof(T));
+		return (T*)arena->allocate(n * sizeof(T), alignof(T));
+	}
+	void deallocate(T* p, size_t) {
+		if (arena == NULL)
+			::operator delete(p);
+	}
+	template <typename U>
+	bool operator==(const scratchAllocator<U> &other) const { return arena == other.arena; }
+	template <typename U>
+	bool operator!=(const scratchAllocator<U> &other) const { return arena != other.arena; }
+};
+
+//a vector and a string of scratch memory.
+template <typename T>
+using scratchVector = vector<T, scratchAllocator<T> >;
+typedef basic_string<char, char_traits<char>, scratchAllocator<char> > scratchString;
+
+//holds the amount of times memory was taken from the heap with new, counted
+//	by the replaced operator new.
+extern atomic<uint64_t> heapAllocations;
+
+// * Instrumentation *
+
+//the counters kept for one command by the dispatch loop.
+struct commandStats {
+	uint64_t calls;
+	uint64_t totalNs;
+	uint64_t maxNs;
+	//the heap allocations made while the command ran.
+	uint64_t allocations;
+	//buckets[i] counts the calls that took [2^(i-1), 2^i) microseconds.
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+//the counters of every command, builtins by their index in 'builtinCommands'.
+//	the keys of 'extra' are owned by 'extraCommands'.
+struct statsTable {
+	commandStats builtins[BUILTIN_COUNT];
+	commandStats pipelines;
+	unordered_map<string_view, commandStats> extra;
+};
+
+//holds the counters collected by the dispatch loop.
+extern statsTable commandCounters;
+
+//Post:	The monotonic clock is returned in nanoseconds.
+uint64_t monotonicNs();
+
+//Post:	A call of 'name', or of a pipeline, taking 'ns' and making
+//			'allocations' heap allocations has been counted.
+void recordCommand(string_view name, bool piped, uint64_t ns, uint64_t allocations);
+
+//Post:	'stats' has been printed as a line of counters and the non-empty
+//			latency buckets under it, named 'name'.
+void printStats(string_view name, const commandStats &stats);
+
+//how list, stats and jobs print their results, for people or for programs.
+//	FORMAT_JSON writes one JSON object per line and FORMAT_NUL ends each
+//	record with a NUL, so a name with a newline can't split one.
+enum outputFormat { FORMAT_TEXT, FORMAT_JSON, FORMAT_NUL };
+
+//declared with the list engine.
+struct outputBuffer;
+
+//Pre:	'format' is FORMAT_JSON or FORMAT_NUL.
+//Post:	'stats' has been appended to 'out' as one record named 'name'.
+void appendStatsRecord(outputBuffer &out, string_view name, const commandStats &stats, 
+	outputFormat format);
+
+//Post:	The times, faults and context switches of 'u' have been added to
+//			'total', and its maximum RSS raised to the larger of the two.
+void addUsage(rusage &total, const rusage &u);
+
+//Post:	'name' runs 'fn' from now on, replacing an earlier registration.
+//		Builtins can't be replaced, false is returned for them.
+bool registerCommand(string_view name, function fn);
+
+//Post:	The plugin for the command word 'name' has been loaded if one of the
+//			plugin directories has a "<name>.so". true is returned if it
+//			registered 'name'.
+bool loadCommandPlugin(string_view name);
+
+//Post:	The shared object 'path' has been opened and its init function run.
+//		false is returned and an error printed if it isn't a valid plugin.
+bool loadPlugin(const string &path);
+
+//the register_command of the plugin host. the command is registered as
+//	pluginCommand, plugin functions don't take the scratch memory.
+int pluginRegister(const char* name, smash_command fn);
+
+//Post:	The plugin function registered for the command word a[0] has run.
+void pluginCommand(char** a, int len, scratchArena &scratch);
+
+// * Tracing *
+
+//holds whether spans are being recorded. while it's off a traceScope
+//	costs the one load and branch of its constructor.
+extern atomic<bool> tracingEnabled;
+
+//a finished span, kept by value so its name outlives the command line.
+struct traceSpan {
+	uint64_t start;
+	uint64_t end;
+	//what the span worked on, a byte count, a pid or an entry count.
+	int64_t arg;
+	int32_t tid;
+	char name[TRACE_NAME_SIZE];
+};
+
+//the spans of one thread. only the owning thread writes them, a dump
+//	reads up to 'head' and drops what was overwritten while it copied.
+struct traceRing {
+	atomic<uint64_t> head;
+	//false once the owning thread exited, so a new thread can reuse it.
+	atomic<bool> inUse;
+	traceSpan spans[TRACE_RING_SPANS];
+};
+
+//Post:	A span named 'name' from 'start' to 'end' has been added to the
+//			calling thread's ring, which is made the first time.
+void recordSpan(string_view name, uint64_t start, uint64_t end, int64_t arg);
+
+//records the time from its construction to its destruction as a span.
+//	'name' must stay valid until then.
+struct traceScope {
+	uint64_t start;
+	string_view name;
+	int64_t arg;
+
+	traceScope(string_view name, int64_t arg = 0) : start(0), name(name), arg(arg) {
+		if (__builtin_expect(tracingEnabled.load(memory_order_relaxed), 0))
+			start = monotonicNs();
+	}
+	~traceScope() {
+		if (__builtin_expect(start != 0, 0))
+			recordSpan(name, start, monotonicNs(), arg);
+	}
+};
+
+//Post:	The spans recorded so far are left out of later dumps.
+void clearTrace();
+
+//Post:	The spans recorded since the last "trace clear" have been appended
+//			to 'out', as Chrome trace-event JSON or as folded stacks with
+//			the microseconds spent in each.
+void dumpTrace(outputBuffer &out, bool folded);
+
+// * Helper Functions *
+
+//reads the input a line at a time with read(2). the buffer is kept between
+//	lines and only grows, so reading doesn't allocate once it is big enough.
+//	a script or "-c" string is read in place from memory instead.
+struct lineReader {
+	//the descriptor to read from, -1 when all of the input is in 'data'.
+	int fd;
+	vector<char> buffer;
+	//the input being read, buffer.data() unless it is in memory.
+	char* data;
+	size_t capacity;
+	//the unread bytes are data[begin, end).
+	size_t begin;
+	size_t end;
+	bool eof;
+};
+
+//what to do when a copy would overwrite an existing file.
+enum overwritePolicy { OVERWRITE_ASK, OVERWRITE_ALWAYS, OVERWRITE_NEVER };
+
+//holds how the interpreter was started.
+struct sessionOptions {
+	//true when commands are typed at a terminal, so the prompt is shown.
+	bool interactive;
+	overwritePolicy overwrite;
+	//true to keep directory listings in memory between list commands.
+	bool listCache;
+	//true to have a thread write the output of a script.
+	bool asyncOutput;
+};
+
+//a word with an unquoted wildcard. 'pattern' is its offset in the
+//	patterns of the line when some of its characters were quoted, and
+//	NO_PATTERN when the word itself is the pattern.
+struct globWord {
+	size_t token;
+	size_t pattern;
+	//where its matches start in the expanded paths of the line, and how many.
+	size_t first;
+	size_t count;
+};
+
+//the tokens of one input line. they point into the line reader's buffer,
+//	where each one has been unquoted and NUL terminated in place, or into
+//	'expanded' for the names a wildcard matched.
+struct tokenList {
+	vector<string_view> tokens;
+	//the same tokens as cstrings with a NULL after the last, for the commands.
+	vector<char*> args;
+	//true when the line has an unquoted "|" token.
+	bool piped;
+	vector<globWord> globs;
+	//the patterns of words that mix quoted and unquoted wildcards, with the
+	//	quoted ones escaped by a backslash.
+	vector<char> patterns;
+	//the offsets in the current word of quoted wildcard characters.
+	vector<size_t> quotedMetas;
+	//the paths the wildcards matched, one after the other, each NUL terminated.
+	vector<char> expanded;
+};
+
+//the reader for the interpreter's input, shared by the prompt and questions.
+extern lineReader input;
+//how the interpreter was started, set once from the command line.
+extern sessionOptions session;
+
+//Pre:	'reader' has been initialised by initReader.
+//Post:	'line' points at the next line of input without its newline, and
+//			'length' holds its size. It stays valid until the next call.
+//		false is returned at the end of the input.
+bool readLine(lineReader &reader, char* &line, size_t &length);
+
+//Post:	The next line of input has been copied to 'answer' without its
+//			newline, and false is returned if there was none. Unlike
+//			readLine the buffered bytes are never moved or overwritten, so
+//			the tokens of the line being run stay valid.
+bool readAnswer(lineReader &reader, string &answer);
+
+//Post:	'reader' reads from 'fd' with a buffer of 'size' bytes.
+void initReader(lineReader &reader, int fd, size_t size);
+
+//Pre:	'data' holds 'length' bytes that may be modified.
+//Post:	'reader' returns the lines of 'data' without copying them.
+void initReader(lineReader &reader, char* data, size_t length);
+
+//Post:	'reader' reads the script 'fileName' from a private writable mapping,
+//			or with a BATCH_BUFFER_SIZE buffer if it can't be mapped.
+//		false is returned and an error printed if it can't be opened.
+bool openScript(lineReader &reader, const char* fileName);
+
+//Pre:	'argv' holds the arguments smash was started with.
+//Post:	'opts' and 'input' are set up for
+//			"[-f|-n] [--list-cache] [--async-output] [-c <commands> | <script>]".
+//		false is returned and the usage printed if they are invalid.
+bool parseSession(int argc, char** argv, sessionOptions &opts);
+
+//Pre:	'line' holds 'length' bytes of input.
+//Post:	'list' holds the words of the line. Whitespace separates them, single
+//			quotes keep everything literally, double quotes keep everything
+//			but '\"' and '\\', and a backslash outside quotes escapes the next
+//			character. The first word is converted to lower case.
+//		A later word with an unquoted '*', '?' or '[' is replaced by the
+//			paths it matches, and kept as it is when none do.
+//		false is returned and an error printed for an unterminated quote.
+bool tokenize(char* line, size_t length, tokenList &list);
+
+//Pre:	The word from 'start' to 'end' is the next token of 'list', and
+//			'list.quotedMetas' holds the offsets of its quoted wildcards.
+//Post:	The word has been added to 'list.globs' with its pattern.
+void addGlobWord(tokenList &list, const char* start, const char* end);
+
+//Pre:	'list' holds the tokens of a line and the words of 'list.globs'.
+//Post:	Each of those words has been replaced by the paths it matches.
+void expandGlobs(tokenList &list);
+
+//Pre:	'list' is reused between lines so its vectors keep their capacity.
+//Post:	'list' holds the tokens of the next input line.
+//		false is returned at the end of the input. 'list' is left empty and
+//			an error printed when the line can't be tokenized.
+bool parse(tokenList &list);
+
+//Pre: 'iStream' is the memory address of the ifstream to open.
+//      'fileName' is the location/name of the file to open the stream with.
+//Post: 'iStream' has been created OR opening of stream failed 
+//			and program has exited.
+bool createInStream(ifstream &iStream, const char fileName[]);
+
+//Pre: Location/name of the file to validate.
+//Post: Checks if the output file exists. If it does, a warning is prompted 
+//			to the user. If user opts to quit, the program exits.
+//		With "-f" the file is overwritten and with "-n" it is kept without
+//			asking. A script never asks, it keeps the file unless "-f" was given.
+bool validateOutFile(const char fileName[]);
+
+//Pre:  'oStream' is the memory address of the ofstream to open.
+//      'fileName' is the location/name of the file to open the stream with.
+//Post: 'oStream' has been created OR opening of stream failed and 
+//			program has exited.
+bool createOutStream(ofstream &oStream, const char fileName[]);
+
+// * Output Sink *
+
+//the ring buffer every command's output goes through on its way to stdout.
+//	cout writes into it, as do the listings. it is written out with writev
+//	at the prompt, on a flush, once SINK_FLUSH_THRESHOLD bytes are waiting,
+//	or in batch mode by a writer thread so a slow terminal or pipe doesn't
+//	hold up the commands.
+struct outputSink : public streambuf {
+	int fd;
+	char ring[SINK_BUFFER_SIZE];
+	//the amount of bytes ever written out and ever appended, the ring holds
+	//	the ones between them.
+	size_t tail;
+	size_t head;
+	//the position a flush is waiting for the writer thread to reach.
+	size_t flushTarget;
+	//true while one thread is writing, the others wait for it.
+	bool writing;
+	bool threaded;
+	bool stopping;
+	mutex lock;
+	condition_variable changed;
+	thread writer;
+
+	outputSink(int fd) : fd(fd), tail(0), head(0), flushTarget(0), writing(false), 
+		threaded(false), stopping(false) {}
+	//Post:	'n' bytes of 's' have been appended, waiting for room when the
+	//			ring is full.
+	void write(const char* s, size_t n);
+	//Post:	Everything appended so far has been written out.
+	void flush();
+	//Post:	The writer thread is draining the ring.
+	void start();
+	//Post:	The ring has been flushed and the writer thread stopped.
+	void stop();
+	//Pre:	'guard' holds 'lock'.
+	//Post:	What the ring held has been written with writev, without holding
+	//			the lock while writing.
+	void drain(unique_lock<mutex> &guard);
+	void writerLoop();
+
+	streamsize xsputn(const char* s, streamsize n) override;
+	int overflow(int c) override;
+	int sync() override;
+};
+
+//holds the sink in front of stdout.
+extern outputSink stdoutSink;
+
+//holds where the calling thread's output is collected instead of going
+//	to the sink, used by the worker threads of parallel. NULL otherwise.
+extern thread_local vector<char>* capturedOutput;
+
+//Pre:	initJobs has run, so a writer thread has SIGCHLD blocked as well.
+//Post:	cout writes into 'stdoutSink', which is flushed at exit. With
+//			'threaded' a writer thread drains it.
+void initOutput(bool threaded);
+
+//Post:	The writer thread has been stopped, everything written out and cout
+//			set back to its own buffer.
+void finishOutput();
+
+// * Copy Engine *
+
+//the result of a single copy engine stage.
+//COPY_DONE means the stage moved all remaining data, COPY_UNSUPPORTED means
+//	the stage cannot be used for this pair of files and the next stage should
+//	be tried, and COPY_FAILED means a real I/O error occurred (errno is set).
+enum copyResult { COPY_DONE, COPY_UNSUPPORTED, COPY_FAILED };
+
+//Pre:	'inFd' is open for reading and 'outFd' is open for writing and empty.
+//		'size' is the source's size, or 0 if it is unknown (pipes, devices).
+//Post:	All data in 'inFd' has been copied to 'outFd' without passing through
+//			user space when possible. The stages are tried in order:
+//			reflink, copy_file_range, sendfile, mmap, splice, then read/write.
+//		A source with holes only has its data extents copied, so the copy
+//			stays sparse.
+//		true is returned on success. On failure false is returned and errno
+//			holds the cause.
+bool copyFileData(int inFd, int outFd, off_t size);
+
+//Post:	'outFd' shares the extents of 'inFd' (btrfs/XFS reflink), so the copy
+//			completed in constant time. COPY_UNSUPPORTED is returned when the
+//			files are on different filesystems or reflinks are not supported.
+copyResult reflinkCopy(int inFd, int outFd);
+
+//Pre:	'offset' is the amount of bytes already copied.
+//Post:	The data from 'offset' up to 'size' has been copied by the kernel.
+//		'offset' is advanced by the amount of bytes copied, even on failure,
+//			so the next stage can resume where this one stopped.
+copyResult rangeCopy(int inFd, int outFd, off_t &offset, off_t size);
+copyResult sendfileCopy(int inFd, int outFd, off_t &offset, off_t size);
+
+//Post:	The data from 'offset' up to 'size' has been written straight from a
+//			sequential, huge page advised mapping of 'inFd', one aligned
+//			window at a time. For filesystems without copy_file_range or
+//			sendfile support (FUSE, some network mounts).
+//		A source that shrinks returns COPY_UNSUPPORTED at 'offset', for the
+//			buffered stages to finish.
+copyResult mmapCopy(int inFd, int outFd, off_t &offset, off_t size);
+
+//Pre:	['start', 'end') of 'inFd' has been copied to the same range of 'outFd'.
+//Post:	For copies bigger than CACHE_DROP_THRESHOLD, the range's pages have
+//			been dropped from the page cache once the output is written back,
+//			so a big copy doesn't push out the cache of other programs.
+void dropCopiedPages(int inFd, int outFd, off_t start, off_t end, off_t size);
+
+//Post:	The data from 'offset' until the end of 'inFd' has been moved through
+//			a pipe with splice, which works for any pair of descriptors.
+copyResult spliceCopy(int inFd, int outFd, off_t &offset);
+
+//Post:	The data from 'offset' until the end of 'inFd' has been copied through
+//			a user space buffer. This is the last resort and always applies.
+copyResult bufferCopy(int inFd, int outFd, off_t &offset);
+
+//Post:	true is returned if the regular file 'fd' of 'size' bytes has fewer
+//			blocks allocated than its size needs, so it has holes.
+bool hasHoles(int fd, off_t size);
+
+//Pre:	'inFd' and 'outFd' are regular files and 'size' is the source's size.
+//Post:	Only the data extents found with SEEK_DATA/SEEK_HOLE have been copied,
+//			the holes are left unwritten (and punched if 'outFd' had data
+//			there) and 'outFd' has been truncated to 'size'.
+//		COPY_UNSUPPORTED is returned if the filesystem can't report holes.
+copyResult sparseCopy(int inFd, int outFd, off_t size);
+
+//Post:	The data in ['offset', 'end') has been copied at the same offsets with
+//			copy_file_range, sendfile or pread/pwrite, 'offset' is advanced.
+copyResult extentCopy(int inFd, int outFd, off_t &offset, off_t end);
+
+//holds the options that can be given to the copy command.
+struct copyOptions {
+	//amount of threads for a chunked copy, 0 means use the copy engine.
+	//	for a recursive copy this is the amount of copier threads.
+	int jobs;
+	//true when a whole directory tree should be copied.
+	bool recursive;
+	//true to bypass the page cache with O_DIRECT.
+	bool direct;
+	//true to checksum the data and read the destination back to compare.
+	bool verify;
+	//true to only write the parts of an existing destination that changed.
+	bool update;
+};
+
+//Pre:	'a' and 'len' are the arguments given to copy_cmd.
+//Post:	'opts' holds the options found in front of the file names and the
+//			index of the first file name is returned.
+//		-1 is returned and an error is printed if an option is invalid.
+int parseCopyOptions(char** a, int len, copyOptions &opts);
+
+//Pre:	'inFd' and 'outFd' are open regular files, 'size' is the source's size.
+//Post:	The destination has been preallocated and 'jobs' threads have copied
+//			the source in PARALLEL_CHUNK_SIZE ranges with pread/pwrite.
+//		The live throughput is printed while copying if stdout is a terminal.
+//		true is returned on success, otherwise false with errno set.
+bool parallelCopy(int inFd, int outFd, off_t size, int jobs);
+
+//a pool of DIRECT_ALIGN aligned DIRECT_BLOCK_SIZE buffers, kept between
+//	direct copies so they're only allocated once.
+struct alignedPool {
+	mutex lock;
+	vector<char*> free;
+
+	//Post:	A buffer is returned, taken from the pool or newly allocated.
+	char* take();
+	//Post:	'buffer' is back in the pool for the next take.
+	void give(char* buffer);
+};
+
+//holds the buffers of direct I/O copies.
+extern alignedPool directBuffers;
+
+//Pre:	'inFd' and 'outFd' are open regular files, 'size' is the source's size.
+//Post:	Both files have been switched to O_DIRECT and 'depth' workers have
+//			copied DIRECT_BLOCK_SIZE blocks with pread/pwrite, so neither
+//			file goes through the page cache. The unaligned tail is written
+//			as a padded block and cut off with ftruncate.
+//		COPY_UNSUPPORTED is returned if a filesystem refuses O_DIRECT.
+copyResult directCopy(int inFd, int outFd, off_t size, int depth);
+
+//Pre:	'inFd' is an open regular file of 'size' bytes, 'outFd' a regular
+//			file open for reading and writing.
+//Post:	'jobs' threads have compared the files in DELTA_BLOCK_SIZE blocks
+//			and written only the blocks that differ, the destination has
+//			been resized to 'size'. 'changed' holds the amount of bytes
+//			written.
+//		false is returned with errno set if reading or writing failed.
+bool deltaCopy(int inFd, int outFd, off_t size, int jobs, off_t &changed);
+
+//Post:	'dst' has been brought up to date with 'src': left alone when its size
+//			and modification time match, otherwise only the changed blocks
+//			have been rewritten by 'jobs' threads. It then has the source's
+//			times, and how much was written has been printed.
+//		An existing 'dst' is left alone when the session never overwrites.
+void updateFile(const char* src, const char* dst, int jobs);
+
+//a file found by the directory walker of a recursive copy.
+//'path' is relative to both the source and the destination root.
+struct copyTask {
+	string path;
+};
+
+//a bounded queue that hands copy tasks from the walker to the copier threads.
+//push blocks while the queue is full, pop blocks while it is empty and
+//	returns false once the queue has been closed and drained.
+struct copyQueue {
+	deque<copyTask> tasks;
+	bool closed;
+	mutex lock;
+	condition_variable notEmpty, notFull;
+
+	copyQueue() : closed(false) {}
+	void push(const copyTask &task);
+	//replaces 'out' with up to 'max' tasks, waiting for at least one.
+	bool pop(vector<copyTask> &out, size_t max);
+	void close();
+};
+
+//holds the totals of a recursive copy, updated by every copier thread.
+struct treeCopyStats {
+	atomic<long> files, dirs, failed;
+	atomic<off_t> bytes;
+	mutex errorLock;
+	treeCopyStats() : files(0), dirs(0), failed(0), bytes(0) {}
+	//counts a file that was copied.
+	void copied(off_t size);
+	//counts a file that failed and prints why.
+	void error(const char* path, int err);
+};
+
+//Pre:	'src' is a directory, 'dst' is where the copy of the tree will be made.
+//		'jobs' is the amount of copier threads to use.
+//Post:	The tree under 'src' has been recreated under 'dst'. The walker runs
+//			on the calling thread and creates every directory before queueing
+//			its files, so the copier threads never wait on a directory.
+//		The amount of files, bytes and files/s have been printed.
+void treeCopy(const char* src, const char* dst, int jobs);
+
+//Pre:	'path' is a regular file relative to both roots.
+//Post:	The file has been copied with the copy engine and counted in 'stats'.
+void copyTreeFile(int srcRootFd, int dstRootFd, const char* path, treeCopyStats &stats);
+
+//Pre:	'srcDirFd' is the open source directory at 'relPath' (relative to both
+//			roots, "" for the roots themselves).
+//Post:	Every entry below 'relPath' has been created (directories, symlinks)
+//			or queued for copying (regular files).
+void walkCopyTree(int srcRootFd, int dstRootFd, int srcDirFd, const string &relPath,
+	const struct stat &dstRootStat, copyQueue &queue, treeCopyStats &stats);
+
+// * Checksums *
+
+//the streaming state of an XXH3-64 hash. input is buffered until more than
+//	XXH3_BUFFER_SIZE bytes arrived, so short inputs are hashed in one piece.
+struct xxh3State {
+	uint64_t acc[8];
+	unsigned char buffer[XXH3_BUFFER_SIZE];
+	size_t bufferedSize;
+	//the stripes of the current block that went into 'acc'.
+	size_t stripesSoFar;
+	uint64_t totalLength;
+	//the last XXH3_STRIPE_LEN bytes consumed, the final stripe may need them.
+	unsigned char lastStripe[XXH3_STRIPE_LEN];
+};
+
+//Post:	'state' has been reset to hash a new input with the default secret.
+void xxh3Reset(xxh3State &state);
+
+//Post:	'length' bytes of 'data' have been added to the hash.
+void xxh3Update(xxh3State &state, const void* data, size_t length);
+
+//Post:	The XXH3-64 hash of everything added to 'state' is returned, the
+//			state itself is left unchanged.
+uint64_t xxh3Digest(const xxh3State &state);
+
+//Post:	The XXH3-64 hash of 'length' bytes of 'data' is returned.
+uint64_t xxh3Hash(const void* data, size_t length);
+
+//Post:	'hash' is returned as 16 lower case hex digits in 'scratch'.
+const char* hexHash(uint64_t hash, scratchArena &scratch);
+
+//the kernel that accumulates stripes, picked once for the CPU (AVX-512,
+//	AVX2, SSE2 or scalar). they all give the same result.
+typedef void (*xxh3AccumulateFn)(uint64_t* acc, const unsigned char* input, 
+	const unsigned char* secret, size_t stripes);
+
+//Post:	The fastest kernel this CPU supports is returned, and its name in
+//			'name' if it isn't NULL.
+xxh3AccumulateFn xxh3Kernel(const char** name = NULL);
+
+//Pre:	'fd' is open for reading.
+//Post:	'hash' holds the XXH3-64 hash of the file from 'fd's offset 0 to its
+//			end, read with HASH_BUFFER_SIZE preads. false is returned with
+//			errno set if reading failed.
+bool hashFile(int fd, uint64_t &hash);
+
+//Pre:	'inFd' and 'outFd' are open regular files, 'outFd' is empty.
+//Post:	The source has been copied through a buffer, hashing each block as
+//			it passes. The destination has then been flushed, dropped from
+//			the page cache and read back once to confirm it has the same
+//			hash, which is returned in 'hash'.
+//		false is returned with errno set if either failed, EBADMSG if the
+//			destination's hash differs ('badHash' holds it).
+bool verifiedCopy(int inFd, int outFd, uint64_t &hash, uint64_t &badHash);
+
+// * io_uring Engine *
+
+//true when the kernel supports every io_uring operation the engines use.
+//	set once by uringInitEngine, the POSIX paths are used otherwise.
+extern bool uringEnabled;
+
+//a mapped io_uring instance. the pointers point into the shared rings.
+struct uringQueue {
+	int fd;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	io_uring_sqe* sqes;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	io_uring_cqe* cqes;
+	void* sqRing;
+	void* cqRing;
+	size_t sqRingSize, cqRingSize, sqesSize;
+	//amount of entries queued but not submitted, and submitted but not reaped.
+	unsigned queued, inFlight;
+};
+
+//Post:	'uringEnabled' is true if an io_uring can be created and supports
+//			openat, statx, read, write and close. Setting the SMASH_IO_ENGINE
+//			environment variable to "posix" keeps the engine disabled.
+void uringInitEngine();
+
+//Post:	'uringEnabled' is returned. The kernel is probed by the first call,
+//			from any thread, so starting the interpreter doesn't pay for
+//			creating a ring when no command needs one.
+bool uringAvailable();
+
+//Post:	'ring' is set up with 'entries' submission entries and true is
+//			returned, otherwise false is returned and nothing needs freeing.
+bool uringSetup(uringQueue &ring, unsigned entries);
+
+//Post:	The rings of 'ring' have been unmapped and its descriptor closed.
+void uringTeardown(uringQueue &ring);
+
+//a ring kept by one thread between calls, as a thread_local. it is torn
+//	down when the thread exits, walker threads would otherwise leave a
+//	descriptor and its mappings behind every time.
+struct threadRing {
+	uringQueue queue;
+	//0 before the first use, 1 while the ring works, -1 once the POSIX
+	//	calls are used instead.
+	int state;
+
+	threadRing() : state(0) {}
+	~threadRing() {
+		if (state == 1)
+			uringTeardown(queue);
+	}
+};
+
+//Pre:	'ring' has a free submission entry (callers batch less than its size).
+//Post:	An entry for 'op' has been queued. 'userData' is handed back as the
+//			index of its result in uringDrain.
+io_uring_sqe* uringQueueOp(uringQueue &ring, int op, int fd, const void* addr, 
+	unsigned len, __u64 off, __u64 userData);
+
+//Post:	Every queued entry has been submitted and completed. The result of
+//			each is stored in 'results' at the index given as its userData.
+//		false is returned if io_uring_enter itself failed.
+bool uringDrain(uringQueue &ring, int* results);
+
+//Pre:	'tasks' are regular files relative to both roots.
+//Post:	The files have been opened, stat'ed, read, written and closed in
+//			batched rounds of io_uring submissions. Files bigger than
+//			URING_SMALL_FILE have been handed to the regular copy engine.
+void uringCopyFiles(uringQueue &ring, int srcRootFd, int dstRootFd, 
+	const vector<copyTask> &tasks, treeCopyStats &stats);
+
+//Pre:	'names' are 'count' entries of the directory 'dirFd', count is at most
+//			URING_ENTRIES.
+//Post:	'stx' holds the metadata of each name and 'results' 0 or a negative
+//			errno for each, all fetched with a single round of submissions.
+//		false is returned if the ring is unusable and nothing was fetched.
+bool uringStatxBatch(uringQueue &ring, int dirFd, const char* const* names, size_t count,
+	unsigned flags, unsigned mask, struct statx* stx, int* results);
+
+//Pre:	'bytes' were copied in 'seconds'.
+//Post:	The amount of MB and the MB/s rate have been printed, without a newline.
+void printThroughput(off_t bytes, double seconds);
+
+
+// * List Engine *
+
+//the record layout getdents64 fills the buffer with.
+struct linuxDirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+//collects output and writes it to 'fd' with a single write(2) whenever it
+//	fills up, instead of flushing once per line.
+//when 'target' is set the output is collected there instead of written,
+//	and when 'lock' is set it is held around each write so buffers flushed by
+//	different threads don't interleave.
+struct outputBuffer {
+	int fd;
+	vector<char>* target;
+	mutex* lock;
+	size_t used;
+	char data[OUTPUT_BUFFER_SIZE];
+
+	outputBuffer(int fd) : fd(fd), target(NULL), lock(NULL), used(0) {}
+	~outputBuffer() { flush(); }
+	void append(const char* s, size_t n);
+	//flushes first if 'n' more bytes wouldn't fit, so a line that is
+	//	appended in pieces is still written out in one piece.
+	void reserve(size_t n) { if (used + n > OUTPUT_BUFFER_SIZE) flush(); }
+	void flush();
+	//hands 'n' bytes of 's' to the target or the descriptor.
+	void emit(const char* s, size_t n);
+};
+
+//Pre:	'fd' is open for writing.
+//Post:	All 'n' bytes of 's' have been written, retrying short writes.
+//		false is returned if writing failed.
+bool writeAll(int fd, const char* s, size_t n);
+
+//Post:	All 'n' bytes of 's' have been written at 'offset' with pwrite.
+bool writeAllAt(int fd, const char* s, size_t n, off_t offset);
+
+//Post:	The format "--json" or "-0" asks for is returned, FORMAT_TEXT for any
+//			other argument.
+outputFormat parseFormat(const char* arg);
+
+//Post:	The 'n' bytes of 's' have been appended to 'out' escaped for a JSON
+//			string, without the quotes. Bytes that aren't valid UTF-8 are
+//			written as \u00XX.
+void appendJsonChars(outputBuffer &out, const char* s, size_t n);
+
+//Post:	'value' has been appended to 'out' in decimal.
+void appendNumber(outputBuffer &out, int64_t value);
+
+//Post:	The JSON name of the DT_ 'type' ("file", "dir", "link"...) is returned.
+const char* typeName(unsigned char type);
+
+//holds the names of a directory in one contiguous block of memory.
+//each name is NUL terminated in 'bytes' and 'offsets' holds where each starts,
+//	so sorting only moves the offsets and no entry needs its own allocation.
+//the byte in front of each name holds its d_type, so it moves with the name.
+struct nameArena {
+	scratchVector<char> bytes;
+	scratchVector<uint32_t> offsets;
+
+	nameArena() {}
+	//the names are kept in 'scratch' instead of the heap.
+	nameArena(scratchArena &scratch) : bytes(scratch), offsets(scratch) {}
+
+	size_t size() const { return offsets.size(); }
+	const char* name(size_t i) const { return &bytes[offsets[i]]; }
+	unsigned char type(size_t i) const { return bytes[offsets[i] - 1]; }
+	void clear() { bytes.clear(); offsets.clear(); }
+	//appends the 'length' bytes of 'name' with its 'type'.
+	void add(const char* name, size_t length, unsigned char type);
+};
+
+//holds the options that can be given to the list command.
+struct listOptions {
+	//true to print the mode, size and modification time of each entry.
+	bool longFormat;
+	//true to sort the entries by name.
+	bool sorted;
+	//true to list the whole tree below the directory.
+	bool recursive;
+	//true to print a recursive listing in any order, as fast as possible.
+	bool unordered;
+	//amount of walker threads for a recursive listing, 0 to use every core.
+	int jobs;
+	outputFormat format;
+};
+
+//Pre:	'a' and 'len' are the arguments given to list_cmd.
+//Post:	'opts' holds the options found in front of the directory name and
+//			the index of the directory (or 'len' if none) is returned.
+//		-1 is returned and an error is printed if an option is invalid.
+int parseListOptions(char** a, int len, listOptions &opts);
+
+//Post:	The calling thread's DIRENT_BUFFER_SIZE buffer for getdents64 is returned.
+char* direntBuffer();
+
+//Pre:	'dirFd' is an open directory.
+//Post:	The names from one getdents64 call have been appended to 'arena'.
+//		The amount of bytes read is returned, 0 at the end of the directory
+//			and -1 with errno set on errors.
+long readNames(int dirFd, nameArena &arena);
+
+//Post:	The offsets of 'arena' are sorted by name.
+void sortNames(nameArena &arena);
+
+//Pre:	'arena' holds names from the directory 'dirFd'.
+//Post:	The names have been appended to 'out', one per line and each after
+//			'prefix'. With 'longFormat' each line starts with its mode, size
+//			and mtime, fetched with statx in batches of STATX_BATCH_SIZE.
+//		FORMAT_JSON makes each line a JSON object and FORMAT_NUL ends each
+//			name with a NUL, with the fields in front separated by tabs.
+void printNames(int dirFd, const nameArena &arena, bool longFormat, outputFormat format, 
+	outputBuffer &out, const string &prefix = "");
+
+//Pre:	'names' are 'count' entries of the directory 'dirFd' (at most
+//			STATX_BATCH_SIZE).
+//Post:	'stx' holds the metadata of each name and 'results' 0 or a negative
+//			errno for each. statx is relative to 'dirFd', doesn't follow links
+//			and doesn't force network filesystems to sync (AT_STATX_DONT_SYNC).
+//			The batch goes through io_uring when it is enabled.
+void statxNames(int dirFd, const char* const* names, size_t count, struct statx* stx, int* results);
+
+//the steps of a compiled glob component.
+enum globOp { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_SET };
+
+//one character (or run of them for GLOB_STAR) of a compiled component.
+//	'arg' is the character of GLOB_CHAR and the index of the set of GLOB_SET.
+struct globStep {
+	globOp op;
+	unsigned int arg;
+};
+
+//the characters a "[...]" matches, one bit each.
+struct globSet {
+	uint64_t bits[4];
+	bool has(unsigned char c) const { return bits[c >> 6] >> (c & 63) & 1; }
+};
+
+//one '/' separated component of a pattern.
+struct globComponent {
+	//true for "**", which matches any amount of directories.
+	bool recursive;
+	//true when it has no wildcards, 'literal' is opened without reading
+	//	the directory.
+	bool isLiteral;
+	string literal;
+	vector<globStep> steps;
+	vector<globSet> sets;
+	//the characters after the last '*', compared before running the steps
+	//	so most names are turned down with one memcmp.
+	string suffix;
+};
+
+//a pattern compiled once for every directory it is matched in.
+struct globPattern {
+	//the leading components without wildcards, with a '/' after each.
+	string base;
+	vector<globComponent> parts;
+	//true when the pattern ends in '/', it then only matches directories.
+	bool dirsOnly;
+};
+
+//the listing of one directory of a deterministic recursive walk. 'children'
+//	are its subdirectories in name order, both are only valid once 'done'.
+struct walkNode {
+	vector<char> output;
+	vector<walkNode*> children;
+	bool done;
+	walkNode() : done(false) {}
+};
+
+//a directory waiting to be listed by a walker thread.
+struct walkItem {
+	//the open directory, or -1 when it has to be opened from 'path' because
+	//	the process ran out of descriptors while it was queued.
+	int fd;
+	//the path relative to the root, ending in '/' ("" for the root itself).
+	string path;
+	//where the listing goes in a deterministic walk, NULL otherwise.
+	walkNode* node;
+};
+
+//the deque of one walker thread. the owner works from the back and idle
+//	threads steal from the front, so they take the oldest (largest) subtrees.
+struct walkDeque {
+	mutex lock;
+	deque<walkItem> items;
+};
+
+//the state shared by every walker thread of a recursive listing.
+struct treeWalk {
+	int rootFd;
+	listOptions opts;
+	vector<walkDeque*> deques;
+	//amount of directories queued or being listed, the walk ends at 0.
+	atomic<long> pending;
+	atomic<long> errors;
+	//guards the 'done' flags of the nodes, signalled as each one finishes.
+	mutex nodeLock;
+	condition_variable nodeDone;
+	//held around writes of the per-thread buffers in an unordered walk.
+	mutex outLock;
+	//the pattern of a glob walk, which collects the matching paths into
+	//	'matches' instead of listing. NULL for list -R.
+	const globPattern* glob;
+	//the index of the "**" component the walk's root is matched from.
+	size_t globFirst;
+	//the path of the walk's root, in front of every match.
+	string globPrefix;
+	nameArena* matches;
+};
+
+//Pre:	'rootFd' is the open directory to list.
+//Pre:	'walk' has its root and options set.
+//Post:	The tree below 'walk.rootFd' has been walked by 'jobs' walker threads
+//			and, when 'ordered', each directory printed depth first.
+void runTreeWalk(treeWalk &walk, int jobs, bool ordered);
+
+//Post:	Every entry below 'rootFd' has been printed with its path. The tree is
+//			listed by 'opts.jobs' walker threads. A deterministic walk sorts
+//			each directory and prints them depth first, an unordered walk
+//			writes each thread's buffer as soon as it fills.
+void treeList(int rootFd, const listOptions &opts);
+
+//Post:	Directories have been taken from this thread's deque, or stolen from
+//			the others, and listed until the whole tree is done.
+void walkWorker(treeWalk &walk, size_t self);
+
+//Post:	The directory of 'item' has been listed into 'out' and each of its
+//			subdirectories pushed onto the deque of thread 'self'. A glob
+//			walk doesn't list, its matches are added to 'walk.matches' and
+//			hidden directories aren't entered.
+void walkDirectory(treeWalk &walk, size_t self, walkItem &item, outputBuffer &out);
+
+//Pre:	'dirFd' is an open directory.
+//Post:	The name of every entry has been appended to 'out' in 'format', one
+//			per line, reading the entries with getdents64 into a reusable
+//			buffer.
+//		false is returned with errno set if the directory couldn't be read.
+bool listNames(int dirFd, outputFormat format, outputBuffer &out);
+
+//one directory in the listing cache, keyed by its device and inode.
+struct cachedListing {
+	dev_t dev;
+	ino_t ino;
+	//the inotify watch that drops the entry when a name changes, -1 when
+	//	it is checked against the directory's mtime instead.
+	int watch;
+	struct timespec mtime;
+	uint64_t lastUse;
+	//the names in directory order, and in name order once sorted.
+	nameArena names;
+	nameArena sorted;
+	bool hasSorted;
+	//the plain listing in directory and in name order, built on first use.
+	vector<char> output[2];
+	bool hasOutput[2];
+};
+
+//the listings of directories listed before, for sessions started with
+//	--list-cache. a repeated listing is printed from memory without reading
+//	the directory again.
+struct listCache {
+	mutex lock;
+	//the inotify instance, -1 when it isn't available.
+	int inotifyFd;
+	bool started;
+	uint64_t clock;
+	vector<cachedListing> entries;
+};
+
+//holds the cached listings of the session.
+extern listCache listings;
+
+//Pre:	'dirFd' is an open directory.
+//Post:	The directory has been printed to 'out' as list_cmd would, from the
+//			cache while none of its names changed. Otherwise its names have
+//			been read and cached, under an inotify watch that is set up
+//			before reading so nothing changing meanwhile is missed.
+//		false is returned with errno set if the directory couldn't be read.
+bool cachedList(int dirFd, const listOptions &opts, outputBuffer &out);
+
+//Post:	The inotify events that arrived since the last call have been read
+//			and the listings they touch dropped. 'listings.lock' is held.
+void drainListCache();
+
+//Post:	The listing at 'index' has been removed, with its watch.
+void dropListing(size_t index);
+
+// * Glob Expansion *
+
+//Post:	'pattern' has been compiled into 'p'. '*', '?' and "[...]" ("[!...]"
+//			to negate) match within a component, "**" matches any amount of
+//			them, and a backslash makes the next character literal.
+//		false is returned when it has no wildcards.
+bool compileGlob(const char* pattern, globPattern &p);
+
+//Post:	true is returned if the 'length' bytes of 'name' match 'c'. A
+//			leading '.' has to be matched by a literal '.'.
+bool matchComponent(const globComponent &c, const char* name, size_t length);
+
+//Post:	true is returned if the 'count' path components of 'names' match the
+//			components of 'p' from 'first' on.
+bool matchPath(const globPattern &p, size_t first, const string_view* names, size_t count);
+
+//Post:	The paths matching 'pattern' have been added to 'matches' in sorted
+//			order. The amount is returned, 0 if nothing matched.
+size_t expandGlob(const char* pattern, nameArena &matches);
+
+//Pre:	'dirFd' is the open directory 'path' ("" or ending with '/').
+//Post:	The paths below it matching the components of 'p' from 'part' on
+//			have been added to 'matches'. Literal components are opened
+//			directly and "**" is handed to the walker threads of list -R.
+void expandFrom(const globPattern &p, size_t part, int dirFd, string &path, nameArena &matches);
+
+//Post:	The paths below 'dirFd' matching the components of 'p' from the
+//			"**" at 'part' on have been added to 'matches', by a walk like
+//			the one of list -R.
+void globTree(const globPattern &p, size_t part, int dirFd, const string &path, nameArena &matches);
+
+
+// * Process Launch *
+
+//the ways a child process can be started. posix_spawn and the vfork style
+//	clone share the interpreter's memory until exec, so their cost doesn't
+//	grow with its size. fork copies the page tables and is only a fallback.
+enum spawnStrategy { SPAWN_POSIX, SPAWN_VFORK, SPAWN_FORK };
+
+//holds the names of the strategies, indexed by spawnStrategy.
+const char* const spawnNames[] = { "posix_spawn", "clone_vfork", "fork" };
+
+//Pre:	'path' is the program to run and 'argv' its NULL terminated arguments.
+//Post:	The program has been started with 'strategy' and its pid returned.
+//		-1 is returned with errno set if it couldn't be started, including
+//			when exec itself failed in the child.
+//		'redirect' holds the descriptors to use as the child's stdin and
+//			stdout, -1 (or a NULL 'redirect') keeps the interpreter's.
+pid_t spawnProcess(const char* path, char* const argv[], spawnStrategy strategy, 
+	const int* redirect = NULL);
+
+//Post:	The program has been started with posix_spawn, falling back to the
+//			vfork style clone and then fork only if the faster ways fail for
+//			a reason other than the program itself (ENOENT, EACCES...).
+pid_t launchProcess(const char* path, char* const argv[], const int* redirect = NULL);
+
+//a program found by searching $PATH. 'dir' is the index of the directory it
+//	was found in, and 'mtime' that directory's mtime when it was found. the
+//	entry is valid while the directory still has that mtime.
+struct pathCacheEntry {
+	string path;
+	size_t dir;
+	struct timespec mtime;
+	long hits;
+};
+
+//a directory of $PATH.
+struct pathDirectory {
+	string name;
+};
+
+//the command location cache, like the "hash" builtin of other shells.
+//'pathValue' is the $PATH the directories were split from, the whole cache
+//	is dropped if it changes. 'lock' is held while it is used, parallel
+//	resolves programs from several threads.
+struct pathCache {
+	string pathValue;
+	vector<pathDirectory> dirs;
+	unordered_map<string, pathCacheEntry> entries;
+	mutex lock;
+};
+
+//Pre:	'name' is a program name without a '/'.
+//Post:	The full path of the program is returned in 'scratch', or NULL if it
+//			isn't in $PATH.
+//		A cached location only costs a stat of the directory it is in, the
+//			directories of $PATH are only searched when that has changed.
+const char* resolveCommand(const char* name, scratchArena &scratch);
+
+//Post:	The cached location of 'name' has been dropped, the next lookup
+//			searches $PATH again.
+void forgetCommand(const char* name);
+
+//Post:	The program has been started like launchProcess does, and a script
+//			without a #! line (ENOEXEC) has been handed to /bin/sh.
+pid_t launchProgram(const char* path, char* const argv[], const int* redirect = NULL);
+
+//Post:	The program has run with its stdout read through a pipe into 'out',
+//			and been waited for without the job table.
+//		Its wait status is returned, or -1 with errno set if it couldn't start.
+int captureProgram(const char* path, char* const argv[], vector<char> &out);
+
+// * Pipelines *
+
+//one "run" or "tee" stage of a pipeline.
+struct pipeStage {
+	//the program and its NULL terminated arguments, for run stages. both
+	//	are in the command's scratch memory.
+	const char* path;
+	char** argv;
+	//the file a tee stage copies the stream into, -1 for run stages.
+	int teeFd;
+	//the F_SETPIPE_SZ size of the pipe out of this stage, 0 to keep the default.
+	long pipeSize;
+	//true when 'path' was found through the $PATH cache.
+	bool searched;
+};
+
+//Pre:	'a' holds 'len' arguments of a run command, starting with "run".
+//Post:	'stage' holds the resolved program, its arguments and options,
+//			taken from 'scratch'.
+//		false is returned and an error printed if it can't be run.
+bool parseRunStage(char** a, int len, pipeStage &stage, scratchArena &scratch);
+
+//Pre:	Launching 'stage' failed with ENOENT.
+//Post:	If its path came from the $PATH cache the entry has been dropped and
+//			$PATH searched again, and true is returned when that found a
+//			different path to retry with.
+bool refreshStage(pipeStage &stage, scratchArena &scratch);
+
+//Pre:	'a' has at least one "|" argument.
+//Post:	Every stage has been started with pipe2 pipes between them and the
+//			pipeline waited for, or run as a background job with a trailing "&".
+void runPipeline(char** a, int len, scratchArena &scratch);
+
+//Pre:	'inFd' is the read end of the pipe from the previous stage, 'outFd'
+//			the write end of the pipe to the next or -1 for the last stage.
+//Post:	A child of the interpreter has been forked that copies the stream to
+//			'fileFd' and passes it on. 'pipeFds' are the pipeline's other
+//			descriptors, closed in the child so every stage still sees EOF.
+//		The child's pid is returned or -1 with errno set.
+pid_t startTeeStage(int inFd, int outFd, int fileFd, const scratchVector<int> &pipeFds);
+
+//Post:	The stream from 'inFd' has been duplicated into 'outFd' with tee(2)
+//			and moved into 'fileFd' with splice, so it never goes through
+//			user space. When 'outFd' isn't a pipe it is copied with a buffer.
+//		0 is returned on success, 1 on errors.
+int teeStream(int inFd, int outFd, int fileFd);
+
+//Post:	'text' has been read as a size in bytes with an optional K, M or G
+//			suffix, -1 is returned if it isn't one.
+long parseSize(const char* text);
+
+// * Parallel Commands *
+
+//the runs of one parallel command, shared by its worker threads.
+struct parallelRun {
+	function fn;
+	//the command word and its arguments, "{}" marks where each run's
+	//	argument goes.
+	vector<char*> words;
+	bool placeholder;
+	vector<char*> args;
+	//the output of each run, printed once it and the ones before it are done.
+	vector<vector<char> > outputs;
+	vector<char> done;
+	//the next argument a worker takes.
+	atomic<size_t> next;
+	mutex lock;
+	condition_variable finished;
+};
+
+//Post:	The worker has run the command for the arguments it took from 'run'
+//			until none were left, each with its output captured.
+void parallelWorker(parallelRun &run);
+
+//Post:	The words of the run for argument 'task' are returned in 'scratch',
+//			with 'len' set to their amount.
+char** parallelArguments(const parallelRun &run, size_t task, int &len, scratchArena &scratch);
+
+//Post:	The lines of 'file' have been read into 'scratch' and added to 'args',
+//			skipping empty ones. false is returned if it couldn't be read.
+bool readArgumentFile(const char* file, vector<char*> &args, scratchArena &scratch);
+
+// * Job Control *
+
+//a launched command. every child, foreground or background, belongs to a job
+//	so a single reaper can account for all of them.
+struct job {
+	int id;
+	string command;
+	vector<pid_t> pids;
+	//the pidfd watched for each pid, -1 once it has been reaped (or always
+	//	when SIGCHLD arrives through the signalfd instead).
+	vector<int> pidfds;
+	//reaped[i] is true once pids[i] has been waited for. the pids are kept
+	//	so jobs can still show them.
+	vector<bool> reaped;
+	//amount of pids that haven't been reaped yet.
+	int remaining;
+	//the wait status of the last process of the job.
+	int status;
+	bool background;
+	//the resources used by the job's reaped processes.
+	rusage usage;
+};
+
+//the jobs of the interpreter and the epoll set their completions arrive on.
+//children are reaped when their pidfd becomes readable, on kernels without
+//	pidfd_open SIGCHLD is blocked and read from 'signalFd' instead.
+struct jobTable {
+	int epollFd;
+	int signalFd;
+	bool usePidfd;
+	int nextId;
+	vector<job*> jobs;
+	//removed jobs, kept with their buffers for addJob.
+	vector<job*> spare;
+	//the resources of every foreground job removed so far, for time.
+	rusage foregroundUsage;
+	//the largest maximum RSS of a foreground job removed since time last
+	//	cleared it, the one in 'foregroundUsage' is the session's peak.
+	long foregroundPeak;
+};
+
+//Post:	The job table is ready. The pidfd support of the kernel has been
+//			checked and if it's missing SIGCHLD is blocked and routed to a
+//			signalfd. Must run before any thread is started.
+void initJobs();
+
+//Pre:	The 'count' 'pids' are children that were just launched for 'command'.
+//Post:	A job owning the pids has been added to the table and is returned.
+//			Jobs removed before are used again, so a job that fits in one
+//			of them doesn't allocate.
+job* addJob(const pid_t* pids, size_t count, string_view command, bool background);
+
+//Post:	Completions have been read from the epoll set for up to 'timeoutMs'
+//			(-1 blocks until one arrives) and the finished children reaped.
+void pollJobs(int timeoutMs);
+
+//Post:	The interpreter has blocked until every process of 'j' is reaped.
+void waitJob(job* j);
+
+//Post:	'j' has been removed from the table and freed.
+void removeJob(job* j);
+
+//Post:	Finished background jobs have been reported and removed, without
+//			blocking. Called before each prompt.
+void reportJobs();
+
+//Post:	The job numbered 'id' is returned, or NULL if there is none.
+job* findJob(int id);
+
+//Post:	A line with the job's number, state and command has been printed.
+void printJob(const job* j);
+
+//Pre:	'format' is FORMAT_JSON or FORMAT_NUL.
+//Post:	The job's number, state, pids and command have been appended to 'out'
+//			as one record.
+void appendJobRecord(outputBuffer &out, const job* j, outputFormat format);
+
+//Post:	/bin/true has been launched 'iterations' times with each strategy and
+//			the mean and percentile latencies printed. 'ballastMB' of touched
+//			memory are held first, to show how each strategy scales with RSS.
+void spawnBenchmark(int iterations, int ballastMB);
+
+//Post:	The interpreter has been started 'iterations' times with "-c quit",
+//			and the mean and percentile times until it was ready for its
+//			first command and until it exited printed.
+void startupBenchmark(int iterations);
+
+//Post:	When started by --startup-bench, the time since the launch has been
+//			written to stdout as 8 raw bytes, before any other output.
+void reportStartup();
+
+//holds the locations of the programs run by name.
+extern pathCache commandPaths;
+
+//holds every job that was started with run.
+extern jobTable runningJobs;
+
+#endif
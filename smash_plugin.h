@@ -0,0 +1,43 @@
+/******************************************************************
+*
+*	Smash Interpreter
+*	Plugin interface
+*
+*	A plugin is a shared object that adds commands to smash. It is
+*	found through $SMASH_PLUGIN_PATH (default ~/.smash/plugins) and
+*	loaded the first time one of its commands is typed: typing "name"
+*	loads "name.so", whose init function registers "name" and any
+*	other commands it provides.
+*
+*	Build one with:
+*		g++ -std=c++17 -O2 -shared -fPIC name.cpp -o name.so
+*
+*******************************************************************/
+#ifndef SMASH_PLUGIN_H
+#define SMASH_PLUGIN_H
+
+//holds the version of this interface, a plugin built against another
+//	version is refused.
+#define SMASH_PLUGIN_ABI_VERSION 1
+
+//a command function, called with the words of the line (the command
+//	word first, lower cased) and their count.
+typedef void (*smash_command)(char** a, int len);
+
+//what smash hands a plugin when it is loaded.
+struct smash_plugin_host {
+	int abi_version;
+	//Post:	'name' runs 'fn' from now on. 0 is returned, or -1 if 'name'
+	//			is a builtin that can't be replaced.
+	int (*register_command)(const char* name, smash_command fn);
+};
+
+//the function every plugin exports.
+//Post:	The plugin's commands have been registered with 'host'.
+//		0 is returned on success, anything else unloads the plugin.
+extern "C" int smash_plugin_init(const smash_plugin_host* host);
+
+//the name smash looks the init function up by.
+#define SMASH_PLUGIN_INIT "smash_plugin_init"
+
+#endif